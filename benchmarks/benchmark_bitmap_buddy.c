@@ -0,0 +1,142 @@
+#include "memory_allocator.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+// Header-in-block buddy system vs bitmap buddy system. The header-in-block
+// engine rounds every request up after adding its block header, so requests
+// that are already a power of two take a block twice their size; the bitmap
+// engine keeps block state outside the blocks and pays a few bits per block
+// instead.
+
+#define BITMAP_HEAP_SIZE (16 * 1024 * 1024)
+#define BITMAP_MAX_LIVE (BITMAP_HEAP_SIZE / 16)
+#define BITMAP_OPERATIONS 2000000
+#define BITMAP_SLOTS 1000
+#define BITMAP_MAX_SIZE 8192
+#define BITMAP_TAGGED_SIZE 16
+
+static const size_t overhead_sizes[] = {16, 64, 100, 1000, 4096, 10000, 65536};
+#define OVERHEAD_NUM_SIZES (sizeof(overhead_sizes) / sizeof(overhead_sizes[0]))
+
+allocator_t* create_engine_instance(allocator_engine_t engine) {
+    allocator_config_t config = {0};
+    config.heap_size = BITMAP_HEAP_SIZE;
+    config.engine = engine;
+    return allocator_create(&config);
+}
+
+// Allocates 'size' bytes until the heap is full. Returns the number of
+// allocations that fit.
+size_t fill_heap(allocator_engine_t engine, size_t size, void** live) {
+    allocator_t* a = create_engine_instance(engine);
+    if (!a) return 0;
+
+    size_t count = 0;
+    while (count < BITMAP_MAX_LIVE && (live[count] = allocator_malloc(a, size)) != NULL) {
+        count++;
+    }
+
+    allocator_destroy(a);
+    return count;
+}
+
+// Random sizes up to 8KB, alloc/free in random slots. Returns nanoseconds
+// per operation.
+double run_random(allocator_engine_t engine) {
+    allocator_t* a = create_engine_instance(engine);
+    if (!a) return 0.0;
+
+    void* slots[BITMAP_SLOTS] = {0};
+    srand(11); // Same sequence for both engines
+
+    clock_t start = clock();
+    for (int i = 0; i < BITMAP_OPERATIONS; ++i) {
+        int slot = rand() % BITMAP_SLOTS;
+        if (slots[slot]) {
+            allocator_free(a, slots[slot]);
+            slots[slot] = NULL;
+        } else {
+            slots[slot] = allocator_malloc(a, (rand() % BITMAP_MAX_SIZE) + 1);
+        }
+    }
+    clock_t end = clock();
+
+    allocator_destroy(a);
+    return (double)(end - start) / CLOCKS_PER_SEC * 1e9 / BITMAP_OPERATIONS;
+}
+
+// Repeated alloc/free of one size. Returns nanoseconds per alloc/free pair.
+double run_same_size(allocator_engine_t engine, size_t size) {
+    allocator_t* a = create_engine_instance(engine);
+    if (!a) return 0.0;
+
+    clock_t start = clock();
+    for (int i = 0; i < BITMAP_OPERATIONS; ++i) {
+        char* p = (char*)allocator_malloc(a, size);
+        p[0] = (char)i; // Touch the block
+        allocator_free(a, p);
+    }
+    clock_t end = clock();
+
+    allocator_destroy(a);
+    return (double)(end - start) / CLOCKS_PER_SEC * 1e9 / BITMAP_OPERATIONS;
+}
+
+int main() {
+    void** live = (void**)malloc(BITMAP_MAX_LIVE * sizeof(void*));
+    if (!live) return 1;
+
+    printf("--- Benchmarking Bitmap Buddy System ---\n");
+    printf("%dMB heap per engine\n\n", BITMAP_HEAP_SIZE / (1024 * 1024));
+
+    // Bitmaps take a few bits per minimum block up front; headers take a
+    // share of every block, and a whole extra order when they push the
+    // request past a power of two
+    allocator_t* a = create_engine_instance(ALLOCATOR_ENGINE_BITMAP_BUDDY);
+    if (a) {
+        allocator_stats_t stats;
+        allocator_get_stats(a, &stats);
+        printf("Bitmap metadata: %zu bytes (%.2f%% of the heap)\n",
+               (size_t)BITMAP_HEAP_SIZE - stats.heap_size,
+               100.0 * (double)(BITMAP_HEAP_SIZE - stats.heap_size) / BITMAP_HEAP_SIZE);
+
+        // The tag table only exists once something is tagged
+        void* tagged = allocator_malloc_tagged(a, BITMAP_TAGGED_SIZE, 1);
+        allocator_free(a, tagged);
+        allocator_get_stats(a, &stats);
+        printf("Tag table, allocated by the first tagged allocation: %zu bytes (%.2f%% of the heap)\n\n",
+               stats.allocated_bytes,
+               100.0 * (double)stats.allocated_bytes / BITMAP_HEAP_SIZE);
+        allocator_destroy(a);
+    }
+
+    printf("Allocations of one size that fit in the heap:\n");
+    printf("%-10s %12s %12s %16s %16s\n", "size", "header", "bitmap",
+           "header util", "bitmap util");
+    for (size_t i = 0; i < OVERHEAD_NUM_SIZES; ++i) {
+        size_t size = overhead_sizes[i];
+        size_t header = fill_heap(ALLOCATOR_ENGINE_BUDDY, size, live);
+        size_t bitmap = fill_heap(ALLOCATOR_ENGINE_BITMAP_BUDDY, size, live);
+        printf("%-10zu %12zu %12zu %15.1f%% %15.1f%%\n", size, header, bitmap,
+               100.0 * (double)(header * size) / BITMAP_HEAP_SIZE,
+               100.0 * (double)(bitmap * size) / BITMAP_HEAP_SIZE);
+    }
+
+    printf("\nLatency (ns per operation):\n");
+    printf("%-24s %12s %12s %10s\n", "workload", "header", "bitmap", "speedup");
+    double header_random = run_random(ALLOCATOR_ENGINE_BUDDY);
+    double bitmap_random = run_random(ALLOCATOR_ENGINE_BITMAP_BUDDY);
+    printf("%-24s %12.1f %12.1f %9.2fx\n", "random sizes <= 8KB",
+           header_random, bitmap_random, header_random / bitmap_random);
+    for (size_t size = 64; size <= 65536; size *= 32) {
+        char label[32];
+        snprintf(label, sizeof(label), "alloc/free %zu", size);
+        double header = run_same_size(ALLOCATOR_ENGINE_BUDDY, size);
+        double bitmap = run_same_size(ALLOCATOR_ENGINE_BITMAP_BUDDY, size);
+        printf("%-24s %12.1f %12.1f %9.2fx\n", label, header, bitmap, header / bitmap);
+    }
+
+    free(live);
+    return 0;
+}
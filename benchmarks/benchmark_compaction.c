@@ -0,0 +1,130 @@
+#include "memory_allocator.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+// Online defragmentation of the segregated heap through movable (handle)
+// allocations. A long churn run leaves the heap full of small holes between
+// survivors: first small objects, then larger ones that the small holes
+// can't hold, then most objects freed at random. One object in
+// COMPACT_FIXED_EVERY is an ordinary allocation, which compaction has to
+// leave in place. Compaction then runs in bounded steps, and fragmentation
+// and resident memory are compared before and after.
+
+#define COMPACT_HEAP_SIZE (16 * 1024 * 1024)
+#define COMPACT_HANDLES 30000
+#define COMPACT_CHURN 200000
+#define COMPACT_FIXED_EVERY 50
+#define COMPACT_STEP_BYTES (256 * 1024)
+#define COMPACT_KEEP_PERCENT 20
+
+static allocator_handle_t handles[COMPACT_HANDLES];
+static void* fixed[COMPACT_HANDLES]; // Slots that hold an ordinary allocation instead
+
+// Resident set size of the process, from /proc
+size_t resident_bytes(void) {
+    size_t pages = 0, resident = 0;
+    FILE* f = fopen("/proc/self/statm", "r");
+    if (!f) return 0;
+    if (fscanf(f, "%zu %zu", &pages, &resident) != 2) resident = 0;
+    fclose(f);
+    return resident * (size_t)sysconf(_SC_PAGESIZE);
+}
+
+void print_state(const char* label, allocator_t* a) {
+    allocator_stats_t stats;
+    allocator_get_stats(a, &stats);
+    double fragmentation = stats.free_bytes ? 100.0 * (1.0 - (double)stats.largest_free_block / stats.free_bytes) : 0.0;
+    printf("%-8s %12zu %12zu %14zu %12.1f%% %10.1fMB\n", label, stats.free_bytes, stats.free_blocks,
+           stats.largest_free_block, fragmentation, resident_bytes() / (1024.0 * 1024.0));
+}
+
+// Allocates slot 'slot' with 'size' bytes and fills it. Returns 0 on failure.
+int fill_slot(allocator_t* a, int slot, size_t size) {
+    if (slot % COMPACT_FIXED_EVERY == 0) {
+        fixed[slot] = allocator_malloc(a, size);
+        if (!fixed[slot]) return 0;
+        memset(fixed[slot], 0xab, size);
+        return 1;
+    }
+
+    handles[slot] = allocator_handle_alloc(a, size);
+    if (!handles[slot]) return 0;
+    memset(allocator_handle_pin(a, handles[slot]), 0xab, size);
+    allocator_handle_unpin(a, handles[slot]);
+    return 1;
+}
+
+void free_slot(allocator_t* a, int slot) {
+    allocator_free(a, fixed[slot]);
+    allocator_handle_free(a, handles[slot]);
+    fixed[slot] = NULL;
+    handles[slot] = 0;
+}
+
+int main() {
+    allocator_config_t config = {0};
+    config.heap_size = COMPACT_HEAP_SIZE;
+    config.engine = ALLOCATOR_ENGINE_SEGREGATED;
+
+    allocator_t* a = allocator_create(&config);
+    if (!a) {
+        fprintf(stderr, "Failed to create allocator instance for benchmark.\n");
+        return 1;
+    }
+
+    printf("--- Benchmarking Compaction of Movable Allocations ---\n");
+    printf("%dMB segregated heap, %d objects (1 in %d not movable), %d churn operations\n\n",
+           COMPACT_HEAP_SIZE / (1024 * 1024), COMPACT_HANDLES, COMPACT_FIXED_EVERY, COMPACT_CHURN);
+    srand(3);
+
+    // Small objects, then churn towards larger ones the holes can't hold
+    size_t failures = 0;
+    for (int i = 0; i < COMPACT_HANDLES; ++i) {
+        if (!fill_slot(a, i, 16 + rand() % 112)) failures++;
+    }
+    for (int i = 0; i < COMPACT_CHURN; ++i) {
+        int slot = rand() % COMPACT_HANDLES;
+        free_slot(a, slot);
+        size_t size = i < COMPACT_CHURN / 2 ? 16 + rand() % 240 : 128 + rand() % 384;
+        if (!fill_slot(a, slot, size)) failures++;
+    }
+
+    // Most objects go away, the survivors are scattered over the heap
+    for (int i = 0; i < COMPACT_HANDLES; ++i) {
+        if (rand() % 100 >= COMPACT_KEEP_PERCENT) free_slot(a, i);
+    }
+    size_t unmovable = 0;
+    for (int i = 0; i < COMPACT_HANDLES; ++i) {
+        if (fixed[i]) unmovable++;
+    }
+    printf("Churn failed allocations: %zu\n", failures);
+    printf("Unmovable survivors: %zu, so at least %zu free runs after compaction\n\n",
+           unmovable, unmovable + 1);
+
+    printf("%-8s %12s %12s %14s %13s %12s\n", "", "free bytes", "free blocks", "largest free",
+           "fragmented", "RSS");
+    print_state("before", a);
+
+    size_t steps = 0, total = 0;
+    double longest = 0.0;
+    struct timespec start, end;
+    int done = 0;
+    while (!done) {
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        total += allocator_compact(a, COMPACT_STEP_BYTES, &done);
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        double ms = (double)(end.tv_sec - start.tv_sec) * 1e3 + (double)(end.tv_nsec - start.tv_nsec) / 1e6;
+        if (ms > longest) longest = ms;
+        steps++;
+    }
+    print_state("after", a);
+
+    printf("\nCompaction: %zu steps of up to %dKB, %.1fMB moved, longest step %.2fms\n",
+           steps, COMPACT_STEP_BYTES / 1024, total / (1024.0 * 1024.0), longest);
+
+    allocator_destroy(a);
+    return 0;
+}
@@ -0,0 +1,105 @@
+#include "memory_allocator.h"
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+// Contention benchmark: several threads allocate and free from one instance
+// at the same time, once with a single global lock and once with a lock per
+// size class and buddy order. Each thread allocates a batch of objects of
+// mixed sizes (small ones go to the segregated lists, large ones to the buddy
+// system), touches them, and frees them in reverse order.
+
+#define CONTENTION_HEAP_SIZE (64 * 1024 * 1024)
+#define CONTENTION_OPS_PER_THREAD 400000
+#define CONTENTION_BATCH 32
+#define CONTENTION_MAX_THREADS 8
+
+static const size_t contention_sizes[] = {32, 96, 224, 480, 992, 2016, 6000, 12000};
+#define CONTENTION_NUM_SIZES (sizeof(contention_sizes) / sizeof(contention_sizes[0]))
+
+typedef struct {
+    allocator_t* allocator;
+    unsigned int seed;
+    size_t failures;
+} contention_thread_t;
+
+void* contention_worker(void* arg) {
+    contention_thread_t* t = (contention_thread_t*)arg;
+    void* batch[CONTENTION_BATCH];
+
+    for (int done = 0; done < CONTENTION_OPS_PER_THREAD; done += CONTENTION_BATCH) {
+        for (int i = 0; i < CONTENTION_BATCH; ++i) {
+            size_t size = contention_sizes[rand_r(&t->seed) % CONTENTION_NUM_SIZES];
+            batch[i] = allocator_malloc(t->allocator, size);
+            if (batch[i]) {
+                *(volatile char*)batch[i] = (char)i; // Touch the block
+            } else {
+                t->failures++;
+            }
+        }
+        for (int i = CONTENTION_BATCH - 1; i >= 0; --i) {
+            allocator_free(t->allocator, batch[i]);
+        }
+    }
+    return NULL;
+}
+
+// Runs the workload on 'num_threads' threads and returns the wall-clock time
+double run_contention(allocator_lock_mode_t lock_mode, int num_threads) {
+    allocator_config_t config = {0};
+    config.heap_size = CONTENTION_HEAP_SIZE;
+    config.lock_mode = lock_mode;
+
+    allocator_t* a = allocator_create(&config);
+    if (!a) {
+        fprintf(stderr, "Failed to create allocator instance for benchmark.\n");
+        return 0.0;
+    }
+
+    pthread_t threads[CONTENTION_MAX_THREADS];
+    contention_thread_t args[CONTENTION_MAX_THREADS];
+    struct timespec start, end;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (int i = 0; i < num_threads; ++i) {
+        args[i].allocator = a;
+        args[i].seed = (unsigned int)(i + 1);
+        args[i].failures = 0;
+        pthread_create(&threads[i], NULL, contention_worker, &args[i]);
+    }
+    size_t failures = 0;
+    for (int i = 0; i < num_threads; ++i) {
+        pthread_join(threads[i], NULL);
+        failures += args[i].failures;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    // Everything was freed, so the counters must balance again
+    allocator_stats_t stats;
+    allocator_get_stats(a, &stats);
+    if (failures || stats.allocated_bytes != 0 || stats.allocation_count != stats.free_count) {
+        fprintf(stderr, "Unexpected state after run: %zu failed allocations, %zu bytes still allocated\n",
+                failures, stats.allocated_bytes);
+    }
+
+    allocator_destroy(a);
+    return (double)(end.tv_sec - start.tv_sec) + (double)(end.tv_nsec - start.tv_nsec) / 1e9;
+}
+
+int main() {
+    printf("--- Benchmarking Lock Contention ---\n");
+    printf("%d allocations + frees per thread, batches of %d, sizes 32 to 12000 bytes\n\n",
+           CONTENTION_OPS_PER_THREAD, CONTENTION_BATCH);
+    printf("%-8s %18s %18s %10s\n", "threads", "global (Mops/s)", "fine (Mops/s)", "speedup");
+
+    for (int num_threads = 1; num_threads <= CONTENTION_MAX_THREADS; num_threads *= 2) {
+        double ops = 2.0 * CONTENTION_OPS_PER_THREAD * num_threads / 1e6;
+        double global_time = run_contention(ALLOCATOR_LOCK_GLOBAL, num_threads);
+        double fine_time = run_contention(ALLOCATOR_LOCK_FINE, num_threads);
+
+        printf("%-8d %18.2f %18.2f %9.2fx\n", num_threads,
+               ops / global_time, ops / fine_time, global_time / fine_time);
+    }
+    return 0;
+}
@@ -0,0 +1,134 @@
+#include "memory_allocator.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+// Eager vs lazy buddy coalescing. With eager coalescing every free merges
+// the block back up as far as it goes, and the next allocation of the same
+// size splits it all the way down again. Lazy coalescing keeps a few freed
+// blocks per order for reuse instead.
+
+#define LAZY_HEAP_SIZE (16 * 1024 * 1024)
+#define LAZY_CACHE_LIMIT 8
+#define LAZY_LOOP_ITERATIONS 1000000
+#define LAZY_LIVE_BLOCKS 8
+#define LAZY_MIXED_OPERATIONS 300000
+#define LAZY_MIXED_SLOTS 600
+#define LAZY_MIXED_MAX_SIZE (64 * 1024)
+#define LAZY_MIXED_SEEDS 100
+
+allocator_t* create_buddy_instance(size_t cache_limit) {
+    allocator_config_t config = {0};
+    config.heap_size = LAZY_HEAP_SIZE;
+    config.engine = ALLOCATOR_ENGINE_BUDDY;
+    config.buddy_cache_limit = cache_limit;
+    return allocator_create(&config);
+}
+
+// Repeated alloc/free of one size next to a few long-lived blocks.
+// Returns nanoseconds per alloc/free pair.
+double run_same_size(size_t cache_limit, size_t size) {
+    allocator_t* a = create_buddy_instance(cache_limit);
+    if (!a) return 0.0;
+
+    void* live[LAZY_LIVE_BLOCKS];
+    for (int i = 0; i < LAZY_LIVE_BLOCKS; ++i) {
+        live[i] = allocator_malloc(a, size);
+    }
+
+    clock_t start = clock();
+    for (int i = 0; i < LAZY_LOOP_ITERATIONS; ++i) {
+        char* p = (char*)allocator_malloc(a, size);
+        p[0] = (char)i; // Touch the block
+        allocator_free(a, p);
+    }
+    clock_t end = clock();
+
+    for (int i = 0; i < LAZY_LIVE_BLOCKS; ++i) {
+        allocator_free(a, live[i]);
+    }
+    allocator_destroy(a);
+    return (double)(end - start) / CLOCKS_PER_SEC * 1e9 / LAZY_LOOP_ITERATIONS;
+}
+
+// Largest power-of-two allocation that still succeeds. Unlike the free
+// block counts, this includes what flushing the caches would merge.
+size_t largest_allocation(allocator_t* a) {
+    for (size_t size = LAZY_HEAP_SIZE; size >= 64; size /= 2) {
+        void* p = allocator_malloc(a, size - 64);
+        if (p) {
+            allocator_free(a, p);
+            return size;
+        }
+    }
+    return 0;
+}
+
+// Random sizes up to 64KB, freed in random order, on a heap that fills up.
+// Returns the largest allocation left and adds the time taken and failed
+// allocations to the totals.
+size_t run_mixed(size_t cache_limit, unsigned int seed, double* seconds, size_t* failures) {
+    allocator_t* a = create_buddy_instance(cache_limit);
+    if (!a) return 0;
+
+    void* slots[LAZY_MIXED_SLOTS] = {0};
+
+    srand(seed); // Same sequence for both modes
+
+    clock_t start = clock();
+    for (int i = 0; i < LAZY_MIXED_OPERATIONS; ++i) {
+        int slot = rand() % LAZY_MIXED_SLOTS;
+        if (slots[slot]) {
+            allocator_free(a, slots[slot]);
+            slots[slot] = NULL;
+        } else {
+            slots[slot] = allocator_malloc(a, (rand() % LAZY_MIXED_MAX_SIZE) + 1);
+            if (!slots[slot]) (*failures)++;
+        }
+    }
+    clock_t end = clock();
+    *seconds += (double)(end - start) / CLOCKS_PER_SEC;
+
+    size_t largest = largest_allocation(a);
+    allocator_destroy(a);
+    return largest;
+}
+
+int main() {
+    printf("--- Benchmarking Lazy Buddy Coalescing ---\n");
+    printf("Cache limit %d blocks per order, %dMB buddy heap\n\n",
+           LAZY_CACHE_LIMIT, LAZY_HEAP_SIZE / (1024 * 1024));
+
+    printf("Repeated alloc/free of one size (%d iterations, %d blocks kept live):\n",
+           LAZY_LOOP_ITERATIONS, LAZY_LIVE_BLOCKS);
+    printf("%-10s %14s %14s %10s\n", "size", "eager (ns)", "lazy (ns)", "speedup");
+    for (size_t size = 8 * 1024; size <= 64 * 1024; size *= 2) {
+        double eager = run_same_size(0, size);
+        double lazy = run_same_size(LAZY_CACHE_LIMIT, size);
+        printf("%-10zu %14.1f %14.1f %9.2fx\n", size, eager, lazy, eager / lazy);
+    }
+
+    // Which blocks end up free depends on the whole history of placements,
+    // so a single run says little; compare the two modes over many seeds
+    printf("\nMixed sizes up to %d bytes (%d operations over %d slots, %d seeds):\n",
+           LAZY_MIXED_MAX_SIZE, LAZY_MIXED_OPERATIONS, LAZY_MIXED_SLOTS, LAZY_MIXED_SEEDS);
+    double eager_seconds = 0, lazy_seconds = 0;
+    size_t eager_failures = 0, lazy_failures = 0;
+    double eager_largest = 0, lazy_largest = 0;
+    int lazy_smaller = 0, lazy_larger = 0;
+    for (unsigned int seed = 1; seed <= LAZY_MIXED_SEEDS; ++seed) {
+        size_t eager = run_mixed(0, seed, &eager_seconds, &eager_failures);
+        size_t lazy = run_mixed(LAZY_CACHE_LIMIT, seed, &lazy_seconds, &lazy_failures);
+        eager_largest += (double)eager / LAZY_MIXED_SEEDS;
+        lazy_largest += (double)lazy / LAZY_MIXED_SEEDS;
+        lazy_smaller += lazy < eager;
+        lazy_larger += lazy > eager;
+    }
+    printf("%-6s %8.3fs   failed allocations %6zu   mean largest allocation left %8.0f bytes\n",
+           "eager", eager_seconds, eager_failures, eager_largest);
+    printf("%-6s %8.3fs   failed allocations %6zu   mean largest allocation left %8.0f bytes\n",
+           "lazy", lazy_seconds, lazy_failures, lazy_largest);
+    printf("Largest allocation left with lazy coalescing: smaller for %d seeds, larger for %d\n",
+           lazy_smaller, lazy_larger);
+    return 0;
+}
@@ -0,0 +1,106 @@
+#include "memory_allocator.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+// Mixed-lifetime workload: every "request" allocates a burst of transient
+// objects and frees them all at the end, but also allocates a few objects
+// that outlive it. Without hints the survivors land between the transient
+// blocks and pin holes that can never be merged again.
+
+// The heap is kept small enough that free space has to be coalesced and
+// reused, which is where interleaved lifetimes hurt
+#define LIFETIME_HEAP_SIZE (4 * 1024 * 1024)
+#define LIFETIME_REQUESTS 5000
+#define LIFETIME_TRANSIENT_PER_REQUEST 64
+#define LIFETIME_SURVIVORS_PER_REQUEST 2
+#define LIFETIME_MAX_SURVIVORS 4000
+#define LIFETIME_MAX_SIZE 2048
+
+// Runs the workload on a fresh instance and prints its results. Runs in its
+// own process so the peak RSS reported belongs to this run alone. Unhinted,
+// the segregated lists only merge free blocks once nothing fits, so the run
+// splits its way through the whole heap before reusing any of it. Hinted,
+// the transient blocks merge and reuse their own spans, so only a fraction
+// of the heap is ever touched.
+void run_lifetime_workload(const char* label, int use_hints) {
+    allocator_config_t config = {0};
+    config.heap_size = LIFETIME_HEAP_SIZE;
+    config.engine = ALLOCATOR_ENGINE_SEGREGATED;
+
+    allocator_t* a = allocator_create(&config);
+    if (!a) {
+        fprintf(stderr, "Failed to create allocator instance for benchmark.\n");
+        return;
+    }
+
+    unsigned int transient_hint = use_hints ? ALLOC_HINT_TRANSIENT : ALLOC_HINT_NONE;
+    unsigned int survivor_hint = use_hints ? ALLOC_HINT_LONG_LIVED : ALLOC_HINT_NONE;
+
+    void* transient[LIFETIME_TRANSIENT_PER_REQUEST];
+    void** survivors = (void**)calloc(LIFETIME_MAX_SURVIVORS, sizeof(void*));
+    size_t failures = 0;
+
+    srand(42); // Same sequence of sizes for both runs
+
+    clock_t start = clock();
+
+    for (int r = 0; r < LIFETIME_REQUESTS; ++r) {
+        for (int i = 0; i < LIFETIME_TRANSIENT_PER_REQUEST; ++i) {
+            transient[i] = allocator_malloc_hint(a, (rand() % LIFETIME_MAX_SIZE) + 1, transient_hint);
+            if (!transient[i]) failures++;
+        }
+
+        // Survivors replace a random older survivor once the table is full,
+        // so long-lived memory churns slowly as well
+        for (int i = 0; i < LIFETIME_SURVIVORS_PER_REQUEST; ++i) {
+            int slot = rand() % LIFETIME_MAX_SURVIVORS;
+            allocator_free(a, survivors[slot]);
+            survivors[slot] = allocator_malloc_hint(a, (rand() % 256) + 1, survivor_hint);
+            if (!survivors[slot]) failures++;
+        }
+
+        for (int i = 0; i < LIFETIME_TRANSIENT_PER_REQUEST; ++i) {
+            allocator_free(a, transient[i]);
+        }
+    }
+
+    clock_t end = clock();
+
+    allocator_stats_t stats;
+    allocator_get_stats(a, &stats);
+
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+
+    printf("%-10s time %.3fs, failed allocations %zu\n", label,
+           (double)(end - start) / CLOCKS_PER_SEC, failures);
+    printf("%-10s live %zu bytes, free blocks %zu, largest free block %zu bytes, peak RSS %ld KB\n",
+           "", stats.allocated_bytes, stats.free_blocks, stats.largest_free_block, usage.ru_maxrss);
+
+    free(survivors);
+    allocator_destroy(a);
+}
+
+int main() {
+    printf("--- Benchmarking Lifetime Hints ---\n");
+    printf("%d requests, %d transient + %d long-lived allocations each (up to %d bytes)\n\n",
+           LIFETIME_REQUESTS, LIFETIME_TRANSIENT_PER_REQUEST, LIFETIME_SURVIVORS_PER_REQUEST,
+           LIFETIME_MAX_SIZE);
+
+    const char* labels[2] = {"unhinted", "hinted"};
+    for (int use_hints = 0; use_hints < 2; ++use_hints) {
+        fflush(stdout);
+        pid_t pid = fork();
+        if (pid == 0) {
+            run_lifetime_workload(labels[use_hints], use_hints);
+            fflush(stdout);
+            _exit(0);
+        }
+        waitpid(pid, NULL, 0);
+    }
+    return 0;
+}
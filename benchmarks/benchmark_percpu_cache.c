@@ -0,0 +1,142 @@
+#include "memory_allocator.h"
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+
+// Per-CPU vs per-thread caching with many more threads than cores. Every
+// thread allocates a burst of small blocks, touches them and frees them, over
+// and over, on one instance with fine-grained locking:
+//
+//   locked     - no cache, every operation takes a size class lock
+//   per-thread - a cache owned by each thread in front of the instance,
+//                like a thread-local cache would be
+//   per-CPU    - the instance's own per-CPU caches (percpu_cache_limit)
+//
+// Both caches keep the same number of blocks per size class. After the run
+// every block has been freed, so whatever the heap still counts as allocated
+// is memory held in caches. Per-thread caches hold on to it for every thread
+// that has ever allocated, busy or idle; per-CPU caches for every CPU.
+
+#define PERCPU_HEAP_SIZE (64 * 1024 * 1024)
+#define PERCPU_THREADS 1024
+#define PERCPU_ROUNDS 500
+#define PERCPU_BURST 16
+#define PERCPU_LIMIT 32
+
+// Sizes of the blocks in a burst, each its own size class
+static const size_t percpu_sizes[] = {32, 64, 128, 256};
+#define PERCPU_NUM_SIZES (sizeof(percpu_sizes) / sizeof(percpu_sizes[0]))
+
+typedef enum { CACHE_NONE, CACHE_PER_THREAD, CACHE_PER_CPU } cache_mode_t;
+
+// Cache a thread keeps in front of the instance. It outlives the thread, as
+// it would for a thread that is still around but idle.
+typedef struct {
+    size_t count[PERCPU_NUM_SIZES];
+    void* blocks[PERCPU_NUM_SIZES][PERCPU_LIMIT];
+} thread_cache_t;
+
+typedef struct {
+    allocator_t* allocator;
+    cache_mode_t mode;
+    thread_cache_t cache;
+    size_t failures;
+} percpu_thread_t;
+
+void* thread_cache_malloc(percpu_thread_t* t, size_t class_idx) {
+    thread_cache_t* cache = &t->cache;
+    if (t->mode == CACHE_PER_THREAD && cache->count[class_idx] > 0) {
+        return cache->blocks[class_idx][--cache->count[class_idx]];
+    }
+    return allocator_malloc(t->allocator, percpu_sizes[class_idx]);
+}
+
+void thread_cache_free(percpu_thread_t* t, size_t class_idx, void* ptr) {
+    thread_cache_t* cache = &t->cache;
+    if (t->mode == CACHE_PER_THREAD && cache->count[class_idx] < PERCPU_LIMIT) {
+        cache->blocks[class_idx][cache->count[class_idx]++] = ptr;
+        return;
+    }
+    allocator_free(t->allocator, ptr);
+}
+
+void* percpu_worker(void* arg) {
+    percpu_thread_t* t = (percpu_thread_t*)arg;
+    void* burst[PERCPU_BURST];
+
+    for (int round = 0; round < PERCPU_ROUNDS; ++round) {
+        for (int i = 0; i < PERCPU_BURST; ++i) {
+            burst[i] = thread_cache_malloc(t, i % PERCPU_NUM_SIZES);
+            if (burst[i]) {
+                *(volatile char*)burst[i] = (char)i; // Touch the block
+            } else {
+                t->failures++;
+            }
+        }
+        for (int i = PERCPU_BURST - 1; i >= 0; --i) {
+            if (burst[i]) thread_cache_free(t, i % PERCPU_NUM_SIZES, burst[i]);
+        }
+    }
+    return NULL;
+}
+
+// Runs the workload on every thread at once. Prints throughput and the
+// memory left in caches.
+void run_percpu(const char* label, cache_mode_t mode) {
+    allocator_config_t config = {0};
+    config.heap_size = PERCPU_HEAP_SIZE;
+    config.lock_mode = ALLOCATOR_LOCK_FINE;
+    config.percpu_cache_limit = mode == CACHE_PER_CPU ? PERCPU_LIMIT : 0;
+
+    allocator_t* a = allocator_create(&config);
+    percpu_thread_t* args = (percpu_thread_t*)calloc(PERCPU_THREADS, sizeof(percpu_thread_t));
+    pthread_t* threads = (pthread_t*)calloc(PERCPU_THREADS, sizeof(pthread_t));
+    if (!a || !args || !threads) {
+        fprintf(stderr, "Failed to set up the %s benchmark.\n", label);
+        allocator_destroy(a);
+        free(args);
+        free(threads);
+        return;
+    }
+
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (int i = 0; i < PERCPU_THREADS; ++i) {
+        args[i].allocator = a;
+        args[i].mode = mode;
+        pthread_create(&threads[i], NULL, percpu_worker, &args[i]);
+    }
+    size_t failures = 0;
+    for (int i = 0; i < PERCPU_THREADS; ++i) {
+        pthread_join(threads[i], NULL);
+        failures += args[i].failures;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    double seconds = (double)(end.tv_sec - start.tv_sec) + (double)(end.tv_nsec - start.tv_nsec) / 1e9;
+    double operations = 2.0 * PERCPU_THREADS * PERCPU_ROUNDS * PERCPU_BURST; // Allocs and frees
+
+    allocator_stats_t stats;
+    allocator_get_stats(a, &stats);
+    printf("%-12s %14.2f %18zu %14zu\n", label, operations / seconds / 1e6,
+           stats.allocated_bytes, failures);
+
+    allocator_destroy(a);
+    free(args);
+    free(threads);
+}
+
+int main() {
+    printf("--- Benchmarking Per-CPU Caches ---\n");
+    printf("%d threads on %ld CPUs, bursts of %d blocks of %zu-%zu bytes, %d blocks cached per size class\n\n",
+           PERCPU_THREADS, sysconf(_SC_NPROCESSORS_ONLN), PERCPU_BURST,
+           percpu_sizes[0], percpu_sizes[PERCPU_NUM_SIZES - 1], PERCPU_LIMIT);
+
+    printf("%-12s %14s %18s %14s\n", "cache", "Mops/s", "cached bytes", "failures");
+    run_percpu("locked", CACHE_NONE);
+    run_percpu("per-thread", CACHE_PER_THREAD);
+    run_percpu("per-CPU", CACHE_PER_CPU);
+    return 0;
+}
@@ -0,0 +1,125 @@
+#include "memory_allocator.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+// Cost of per-tag accounting on the alloc/free fast path: the same loop
+// untagged, charged to the thread's current tag, and with an explicit tag,
+// under no locking and under fine-grained locking (where the tag counters
+// are updated atomically). Ends with the table a metrics exporter would
+// scrape after a run with a few subsystems.
+
+#define TAGGED_HEAP_SIZE (16 * 1024 * 1024)
+#define TAGGED_ITERATIONS 2000000
+#define TAGGED_LIVE_BLOCKS 64
+
+// Each slot of the working set always allocates the same size, so the
+// engines reach a steady state and the difference between the runs is the
+// accounting
+static const size_t small_sizes[] = {32, 96, 224, 480};
+static const size_t large_sizes[] = {6000, 12000, 24000};
+
+enum { TAG_NONE = 0, TAG_PARSER = 1, TAG_CACHE = 2, TAG_NETWORK = 3 };
+
+typedef enum { MODE_UNTAGGED, MODE_THREAD_TAG, MODE_EXPLICIT_TAG } tag_mode_t;
+
+allocator_t* create_tagged_instance(allocator_lock_mode_t lock_mode) {
+    allocator_config_t config = {0};
+    config.heap_size = TAGGED_HEAP_SIZE;
+    config.lock_mode = lock_mode;
+    return allocator_create(&config);
+}
+
+// Alloc/free of the sizes in 'sizes' over a small working set.
+// Returns nanoseconds per alloc/free pair.
+double run_tagged(allocator_lock_mode_t lock_mode, tag_mode_t mode, const size_t* sizes, size_t num_sizes) {
+    allocator_t* a = create_tagged_instance(lock_mode);
+    if (!a) return 0.0;
+
+    void* live[TAGGED_LIVE_BLOCKS] = {0};
+    unsigned int previous = allocator_set_thread_tag(mode == MODE_THREAD_TAG ? TAG_PARSER : TAG_NONE);
+
+    clock_t start = clock();
+    for (int i = 0; i < TAGGED_ITERATIONS; ++i) {
+        int slot = i % TAGGED_LIVE_BLOCKS;
+        size_t size = sizes[slot % num_sizes];
+        allocator_free(a, live[slot]);
+        if (mode == MODE_EXPLICIT_TAG) {
+            live[slot] = allocator_malloc_tagged(a, size, TAG_PARSER);
+        } else {
+            live[slot] = allocator_malloc(a, size);
+        }
+    }
+    clock_t end = clock();
+
+    allocator_set_thread_tag(previous);
+    allocator_destroy(a);
+    return (double)(end - start) / CLOCKS_PER_SEC * 1e9 / TAGGED_ITERATIONS;
+}
+
+// A few "subsystems" allocating on one instance, then a scrape
+void run_scrape_example(void) {
+    static const char* tag_names[] = {"untagged", "parser", "cache", "network"};
+    allocator_t* a = create_tagged_instance(ALLOCATOR_LOCK_NONE);
+    if (!a) return;
+
+    void* cache[1000];
+    for (int i = 0; i < 1000; ++i) {
+        cache[i] = allocator_malloc_tagged(a, 512, TAG_CACHE);
+    }
+
+    // The parser tags everything it allocates through the thread's tag
+    unsigned int previous = allocator_set_thread_tag(TAG_PARSER);
+    for (int i = 0; i < 10000; ++i) {
+        void* node = allocator_malloc(a, 64 + (i % 8) * 16);
+        if (i % 10 != 0) allocator_free(a, node); // Keeps one node in ten
+    }
+    allocator_set_thread_tag(previous);
+
+    for (int i = 0; i < 100; ++i) {
+        void* packet = allocator_malloc_tagged(a, 9000, TAG_NETWORK);
+        allocator_free(a, packet);
+    }
+    for (int i = 0; i < 500; ++i) {
+        allocator_free(a, cache[i]);
+    }
+
+    allocator_tag_stats_t stats[ALLOCATOR_MAX_TAGS];
+    size_t count = allocator_get_tag_stats(a, stats, ALLOCATOR_MAX_TAGS);
+
+    printf("%-10s %12s %12s %12s %12s\n", "tag", "live bytes", "peak bytes", "allocations", "frees");
+    for (size_t i = 0; i < count; ++i) {
+        printf("%-10s %12zu %12zu %12zu %12zu\n", tag_names[stats[i].tag], stats[i].live_bytes,
+               stats[i].peak_bytes, stats[i].allocation_count, stats[i].free_count);
+    }
+    allocator_destroy(a);
+}
+
+int main() {
+    printf("--- Benchmarking Tagged Allocations ---\n");
+    printf("%d alloc/free pairs over %d live blocks\n\n", TAGGED_ITERATIONS, TAGGED_LIVE_BLOCKS);
+
+    static const struct {
+        const char* label;
+        allocator_lock_mode_t lock_mode;
+        const size_t* sizes;
+        size_t num_sizes;
+    } cases[] = {
+        {"small, no locking", ALLOCATOR_LOCK_NONE, small_sizes, 4},
+        {"small, fine locking", ALLOCATOR_LOCK_FINE, small_sizes, 4},
+        {"large, no locking", ALLOCATOR_LOCK_NONE, large_sizes, 3},
+        {"large, fine locking", ALLOCATOR_LOCK_FINE, large_sizes, 3},
+    };
+
+    printf("%-22s %14s %14s %14s\n", "workload (ns/pair)", "untagged", "thread tag", "explicit tag");
+    for (size_t i = 0; i < sizeof(cases) / sizeof(cases[0]); ++i) {
+        double untagged = run_tagged(cases[i].lock_mode, MODE_UNTAGGED, cases[i].sizes, cases[i].num_sizes);
+        double thread_tag = run_tagged(cases[i].lock_mode, MODE_THREAD_TAG, cases[i].sizes, cases[i].num_sizes);
+        double explicit_tag = run_tagged(cases[i].lock_mode, MODE_EXPLICIT_TAG, cases[i].sizes, cases[i].num_sizes);
+        printf("%-22s %14.1f %14.1f %14.1f\n", cases[i].label, untagged, thread_tag, explicit_tag);
+    }
+
+    printf("\nScraped tag table:\n");
+    run_scrape_example();
+    return 0;
+}
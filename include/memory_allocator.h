@@ -2,19 +2,220 @@
 #define MEMORY_ALLOCATOR_H
 
 #include <stddef.h> // For size_t
+#include <stdint.h> // For uint64_t
 
 #ifdef __cplusplus
 extern "C" {
 #endif
 
+// An independent heap. my_malloc/my_free and the other my_* and allocator_*
+// functions without an allocator_t* argument use a default instance set up
+// by allocator_init(); allocator_create() makes additional ones.
+typedef struct allocator allocator_t;
+
+// Which engines an instance allocates from
+typedef enum {
+    ALLOCATOR_ENGINE_HYBRID = 0,    // Buddy system above the large threshold, segregated lists below
+    ALLOCATOR_ENGINE_BUDDY,         // Buddy system only
+    ALLOCATOR_ENGINE_SEGREGATED,    // Segregated lists only
+    ALLOCATOR_ENGINE_BITMAP_BUDDY   // Buddy system with headerless, exact power-of-two blocks
+} allocator_engine_t;
+
+// How an instance serializes threads using it at the same time
+typedef enum {
+    ALLOCATOR_LOCK_NONE = 0,        // No locking: one thread at a time only
+    ALLOCATOR_LOCK_GLOBAL,          // One lock around every operation
+    ALLOCATOR_LOCK_FINE             // A lock per segregated size class and per buddy order
+} allocator_lock_mode_t;
+
+// Blocks of one request size to have ready in a latency-critical heap.
+//
+// A latency-critical heap ('latency_critical' below) is set up for a hot path
+// that can't take a page fault or a system call. allocator_create() faults in
+// the whole heap (MAP_POPULATE), locks it into RAM if 'mlock_heap' is set, and
+// allocates and frees the 'warm' blocks so the free lists already hold blocks
+// of those sizes; creation fails if any of that fails. Small requests are
+// rounded up so that their block, header included, is a whole size class,
+// and free blocks are listed under the largest class they cover, so the first
+// block on a class's list always fits. Afterwards the instance makes no
+// system calls and no stdio calls: its locks spin instead of sleeping, it
+// isn't sampled for guard pages, compaction keeps its pages, and a request
+// nothing fits fails with NULL straight away instead of merging free blocks
+// first. Misuse such as a double free is still reported.
+typedef struct {
+    size_t size;                    // Request size, as later passed to allocator_malloc()
+    size_t count;                   // Blocks of that size split off up front
+} allocator_warm_t;
+
+// Configuration for allocator_create(). Zeroed fields take their defaults.
+typedef struct {
+    size_t heap_size;               // Bytes of heap (default 1MB)
+    size_t large_threshold;         // Hybrid: requests above this use the buddy system (default 4096)
+    allocator_engine_t engine;      // Default ALLOCATOR_ENGINE_HYBRID
+    allocator_lock_mode_t lock_mode; // Default ALLOCATOR_LOCK_NONE
+    size_t buddy_cache_limit;       // Lazy buddy coalescing: freed blocks kept per order
+                                    // for reuse before merging (default 0, merge on free)
+    size_t percpu_cache_limit;      // Per-CPU caches in front of the segregated size
+                                    // classes: blocks kept per class per CPU, or per heap
+                                    // if latency-critical (default 0, off)
+    int latency_critical;           // 1: prefaulted heap, no syscalls or stdio after creation (default 0)
+    int mlock_heap;                 // Latency-critical: also lock the heap into RAM (default 0)
+    const allocator_warm_t* warm;   // Latency-critical: blocks to split off up front, by size
+    size_t num_warm;                // Entries in 'warm'
+} allocator_config_t;
+
+
+// Lifetime hints for my_malloc_hint()/allocator_malloc_hint(). Hinted
+// allocations are kept in separate regions of the heap, so objects that stay
+// around don't pin memory that short-lived objects are about to free.
+#define ALLOC_HINT_NONE        0u
+#define ALLOC_HINT_TRANSIENT   (1u << 0)    // Freed shortly after allocation
+#define ALLOC_HINT_LONG_LIVED  (1u << 1)    // Kept for a long time, possibly the whole run
+#define ALLOC_HINT_PER_REQUEST (1u << 2)    // Freed together at the end of a request or phase
+
+// Allocation tags for per-subsystem accounting. Tags are small integers
+// chosen by the application, below ALLOCATOR_MAX_TAGS; tag 0 means untagged
+// and isn't counted separately. A block's tag is kept with the block, so it
+// is credited back when the block is freed, by whichever thread frees it.
+#define ALLOCATOR_MAX_TAGS 64
+
+// Counters of one tag, filled in by allocator_get_tag_stats()
+typedef struct {
+    unsigned int tag;
+    size_t live_bytes;              // Bytes in live allocations, headers included
+    size_t peak_bytes;              // Highest live_bytes so far
+    size_t allocation_count;        // Allocations so far (sample twice for a rate)
+    size_t free_count;              // Frees so far
+} allocator_tag_stats_t;
+
+// Heap usage summary filled in by allocator_get_stats()
+typedef struct {
+    size_t heap_size;               // Bytes managed by the heap
+    size_t allocated_bytes;         // Bytes in allocated blocks, headers included
+    size_t free_bytes;              // Bytes in free blocks
+    size_t allocation_count;        // Allocations made so far
+    size_t free_count;              // Frees made so far
+    size_t free_blocks;             // Number of free blocks on all free lists
+    size_t largest_free_block;      // Size of the largest free block
+    size_t cached_bytes;            // Bytes held in per-CPU caches (counted in allocated_bytes)
+} allocator_stats_t;
+
+// Creates an independent allocator instance with its own heap.
+// 'config' may be NULL for the defaults. Returns NULL on failure.
+allocator_t* allocator_create(const allocator_config_t* config);
+
+// Instance counterparts of my_malloc, my_free, my_realloc and print_allocator_stats
+void* allocator_malloc(allocator_t* a, size_t size);
+void* allocator_malloc_hint(allocator_t* a, size_t size, unsigned int flags);
+void* allocator_malloc_tagged(allocator_t* a, size_t size, unsigned int tag);
+void allocator_free(allocator_t* a, void* ptr);
+void* allocator_realloc(allocator_t* a, void* ptr, size_t new_size);
+void allocator_print_stats(allocator_t* a);
+
+// Fills in 'stats' for instance 'a', or for the default instance if 'a' is NULL.
+void allocator_get_stats(allocator_t* a, allocator_stats_t* stats);
+
+// Fills in up to 'max_stats' entries of 'stats' with the counters of every
+// tag instance 'a' (NULL for the default instance) has seen an allocation
+// of, in tag order. Returns the number of such tags, which may be more than
+// 'max_stats'. Meant to be polled by a metrics exporter.
+size_t allocator_get_tag_stats(allocator_t* a, allocator_tag_stats_t* stats, size_t max_stats);
+
+// Movable allocations. A handle names a block that allocator_compact() may
+// move to close up holes in the segregated heap, so the block is only
+// reached through its handle: allocator_handle_pin() returns its current
+// address, which stays valid until the matching allocator_handle_unpin().
+// Pins nest, and several threads may pin a handle at once. Handles are only
+// freed with allocator_handle_free(), never allocator_free(). 0 is never a
+// valid handle; stale handles are detected.
+typedef uint64_t allocator_handle_t;
+
+// Allocates a movable block of 'size' bytes. Returns 0 on failure.
+allocator_handle_t allocator_handle_alloc(allocator_t* a, size_t size);
+void allocator_handle_free(allocator_t* a, allocator_handle_t handle);
+void* allocator_handle_pin(allocator_t* a, allocator_handle_t handle);
+void allocator_handle_unpin(allocator_t* a, allocator_handle_t handle);
+
+// One incremental compaction step: slides unpinned handle blocks of the
+// segregated heap down over free space, merging the free space into runs
+// in front of the blocks that can't move and at the end of the heap. Runs
+// of 64KB or more go back to the OS (private heaps). Moves at most
+// 'max_bytes' (or one block, if that's bigger), looks at no more than a few
+// thousand blocks, and carries on where the previous step stopped. Returns
+// the bytes moved. Sets '*done' (if not NULL) to 1 when the step ends a
+// pass over the whole heap that moved nothing, else 0.
+size_t allocator_compact(allocator_t* a, size_t max_bytes, int* done);
+
+// Releases an instance's whole heap at once. Every pointer it handed out
+// becomes invalid.
+void allocator_destroy(allocator_t* a);
+
 // Initialize the memory allocator. Must be called once before any other allocator function.
 // Returns 0 on success, -1 on failure.
 int allocator_init(void);
 
+// Like allocator_init(), with a configuration for the default instance
+// (e.g. a lock mode, so my_malloc/my_free can be called from several threads).
+int allocator_init_config(const allocator_config_t* config);
+
+// Shared-memory mode: initializes the allocator on a heap that several
+// processes map at once. 'create' formats a new heap (one process only)
+// laid out by 'config', which may be NULL for the defaults; the lock mode is
+// always ALLOCATOR_LOCK_GLOBAL, and per-CPU caches and latency-critical mode
+// are refused. The others attach with create = 0 and config = NULL, and map
+// the size the heap was created with. Free lists are stored as offsets and
+// guarded by a process-shared global lock, so any attached process may
+// allocate and free. If a process dies holding the lock, the next one to
+// wait for it takes it over and warns on stderr. Use instead of
+// allocator_init(). Returns 0 on success, -1 on failure.
+int allocator_init_shared(const char* name, int create, const allocator_config_t* config); // POSIX shm_open() object
+int allocator_init_shared_fd(int fd, int create, const allocator_config_t* config);        // e.g. a memfd passed between processes
+
+// Converts an allocation to an offset that is valid in every process mapping
+// the same heap, and back to a pointer in this process. NULL maps to 0.
+size_t allocator_ptr_to_offset(const void* ptr);
+void* allocator_offset_to_ptr(size_t offset);
+
+// Persistent mode: initializes the allocator on a heap stored in the file at
+// 'path'. A new file is created and laid out by 'config' (NULL for the
+// defaults), with the same restrictions as allocator_init_shared(). Reopening
+// an existing file ignores 'config' and only maps it, at the size it was
+// created with; allocations, free lists and the root pointer are as they were
+// left. The heap is checked for consistency on open, and refused if the check
+// fails. Use instead of allocator_init(). Returns 0 on success, -1 on failure.
+int allocator_open_file(const char* path, const allocator_config_t* config);
+
+// Flushes a persistent heap to disk. allocator_cleanup() also does this.
+// Returns 0 on success, -1 on failure.
+int allocator_sync(void);
+
+// Stores/retrieves the root allocation of a persistent heap, from which the
+// application finds its data again after reopening. NULL if never set.
+void allocator_set_root(void* ptr);
+void* allocator_get_root(void);
+
+// Checks the heap's free lists, block layout and counters.
+// Returns the number of inconsistencies found (0 if the heap is sound).
+int allocator_check_heap(void);
+
 // Allocates 'size' bytes of memory and returns a pointer to the allocated block.
 // Returns NULL if allocation fails.
 void* my_malloc(size_t size);
 
+// Like my_malloc, with ALLOC_HINT_* flags describing the allocation's expected lifetime.
+void* my_malloc_hint(size_t size, unsigned int flags);
+
+// Like my_malloc, charging the allocation to 'tag'. Allocations without an
+// explicit tag are charged to the calling thread's current tag.
+void* my_malloc_tagged(size_t size, unsigned int tag);
+
+// Sets the calling thread's current tag and returns the previous one, so a
+// subsystem can tag everything it allocates for the duration of a call:
+//   unsigned int prev = allocator_set_thread_tag(TAG_PARSER);
+//   ...
+//   allocator_set_thread_tag(prev);
+unsigned int allocator_set_thread_tag(unsigned int tag);
+
 // Frees the memory block pointed to by 'ptr'. If 'ptr' is NULL, no operation is performed.
 void my_free(void* ptr);
 
@@ -25,11 +226,24 @@ void my_free(void* ptr);
 // Returns a pointer to the reallocated memory block, or NULL if reallocation fails.
 void* my_realloc(void* ptr, size_t new_size);
 
+// Enables sampled guard-page checking. Roughly one in every 'sample_rate'
+// allocations of up to a page is served from a pool of pages flanked by
+// PROT_NONE guard pages; freed sampled blocks are poisoned until reused.
+// Overflows, underflows and use-after-frees on sampled blocks crash with a
+// report on stderr that includes the allocation and free stacks.
+// Sampling is process-wide: instances created while it's on take part too.
+// A 'sample_rate' of 0 stops taking new samples; the pool is released once
+// no instance has sampled blocks left. Returns 0 on success, -1 on failure.
+int allocator_enable_guarded_sampling(unsigned int sample_rate);
+
 // Prints current statistics about the memory allocator's state.
 void print_allocator_stats(void);
 
 // Cleans up and deinitializes the memory allocator.
 // Should be called at the end of the program to release mapped memory.
+// For a shared heap this only unmaps it; the contents stay valid for other
+// processes, and the creator should shm_unlink() the object when done.
+// Guarded sampling stays on for other instances.
 void allocator_cleanup(void);
 
 #ifdef __cplusplus
@@ -1,133 +1,854 @@
+#define _GNU_SOURCE // For MAP_ANONYMOUS, shm_open and ftruncate
 #include "allocator.h"
+#include "memory_allocator.h" // Public API implemented here
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <fcntl.h>
 #include <sys/mman.h>
+#include <sys/stat.h>
 #include <unistd.h>
 #include <assert.h> // For assertions in development
 
-// Global allocator instance
+// Default allocator instance, used by my_malloc/my_free and friends
 allocator_t g_allocator = {0};
 
 // Forward declarations for functions defined in other source files
 // These are not exposed in memory_allocator.h, but used internally by allocator.c
-extern void* buddy_alloc_internal(size_t size);
-extern void buddy_free_internal(void* ptr);
-extern void* seg_alloc_internal(size_t size);
-extern void seg_free_internal(void* ptr);
-extern size_t get_size_class_index(size_t size);
+extern void* buddy_alloc_internal(allocator_t* a, size_t size, int lifetime);
+extern void buddy_free_internal(allocator_t* a, void* ptr);
+extern void* seg_alloc_internal(allocator_t* a, size_t size, int lifetime);
+extern void seg_free_internal(allocator_t* a, void* ptr);
+extern size_t get_size_class_index(const allocator_t* a, size_t size);
 extern int get_order(size_t size);
 
 
-// Initialize the memory allocator
-int allocator_init() {
+// Points an instance's view at a heap mapping
+static void attach_heap(allocator_t* a, void* base, size_t mapping_size, int shared) {
     // Initialize size classes
     for (int i = 0; i < NUM_SIZE_CLASSES; i++) {
-        g_allocator.size_classes[i] = NULL;
         // Calculate class sizes: 16, 32, 64, ..., 16 * 2^(NUM_SIZE_CLASSES-1)
-        g_allocator.class_sizes[i] = MIN_BLOCK_SIZE << i;
+        a->class_sizes[i] = MIN_BLOCK_SIZE << i;
     }
-    
-    // Initialize buddy system free lists
-    for (int i = 0; i < MAX_ORDER; i++) {
-        g_allocator.buddy_free_lists[i] = NULL;
-    }
-    
-    // Allocate main heap using mmap
-    g_allocator.heap_start = mmap(NULL, HEAP_SIZE, 
-                                  PROT_READ | PROT_WRITE,
-                                  MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
-    
-    if (g_allocator.heap_start == MAP_FAILED) {
+
+    a->hdr = (heap_header_t*)base;
+    a->heap_start = base;
+    a->heap_end = (char*)base + mapping_size;
+    a->buddy_heap = HEAP_PTR(a, a->hdr->buddy_heap);
+    a->buddy_heap_size = a->hdr->buddy_heap_size;
+    a->seg_heap = HEAP_PTR(a, a->hdr->seg_heap);
+    a->shared = shared;
+    a->persistent = 0;
+    a->lock_mode = a->hdr->lock_mode;
+    a->guarded = 0;
+    if (a->hdr->engine == ALLOCATOR_ENGINE_BITMAP_BUDDY) {
+        bitmap_buddy_attach(a);
+    }
+}
+
+// Serializes a whole-heap operation (free list walks, checks) against every
+// other operation. With fine-grained locking that means taking every lock, in
+// the same order everywhere: handle table, segregated classes ascending, then
+// buddy orders ascending.
+static void lock_heap(allocator_t* a) {
+    if (a->lock_mode == ALLOCATOR_LOCK_GLOBAL) {
+        heap_lock(&a->hdr->lock);
+    } else if (a->lock_mode == ALLOCATOR_LOCK_FINE) {
+        heap_lock(&a->hdr->handle_lock.word);
+        for (int i = 0; i < NUM_SIZE_CLASSES; i++) heap_lock(&a->hdr->seg_locks[i].word);
+        for (int i = 0; i < MAX_ORDER; i++) heap_lock(&a->hdr->buddy_locks[i].word);
+    }
+}
+
+static void unlock_heap(allocator_t* a) {
+    if (a->lock_mode == ALLOCATOR_LOCK_GLOBAL) {
+        heap_unlock(&a->hdr->lock);
+    } else if (a->lock_mode == ALLOCATOR_LOCK_FINE) {
+        for (int i = MAX_ORDER; i-- > 0;) heap_unlock(&a->hdr->buddy_locks[i].word);
+        for (int i = NUM_SIZE_CLASSES; i-- > 0;) heap_unlock(&a->hdr->seg_locks[i].word);
+        heap_unlock(&a->hdr->handle_lock.word);
+    }
+}
+
+// Fills in defaults for zeroed configuration fields
+static allocator_config_t resolve_config(const allocator_config_t* config) {
+    allocator_config_t resolved = {0};
+
+    if (config) resolved = *config;
+    if (resolved.heap_size == 0) resolved.heap_size = HEAP_SIZE;
+    if (resolved.large_threshold == 0) resolved.large_threshold = LARGE_THRESHOLD;
+
+    // Keep the heap a whole number of minimum blocks
+    resolved.heap_size = (resolved.heap_size + MIN_BLOCK_SIZE - 1) & ~(size_t)(MIN_BLOCK_SIZE - 1);
+    return resolved;
+}
+
+// Sets every lock word of a heap to free, as HEAP_LOCK_* 'kind'
+static void init_locks(heap_header_t* hdr, int kind) {
+    heap_lock_init(&hdr->lock, kind);
+    heap_lock_init(&hdr->handle_lock.word, kind);
+    for (int i = 0; i < NUM_SIZE_CLASSES; i++) heap_lock_init(&hdr->seg_locks[i].word, kind);
+    for (int i = 0; i < MAX_ORDER; i++) heap_lock_init(&hdr->buddy_locks[i].word, kind);
+}
+
+// Lays out a fresh heap in the mapping: header, bitmaps (bitmap buddy engine
+// only), buddy heap, segregated list heap
+static void format_heap(allocator_t* a, void* base, size_t mapping_size,
+                        const allocator_config_t* config, int shared) {
+    heap_header_t* hdr = (heap_header_t*)base;
+    size_t heap_size = mapping_size - HEAP_HEADER_SIZE;
+
+    memset(hdr, 0, sizeof(*hdr));
+    hdr->version = HEAP_VERSION;
+    hdr->heap_size = mapping_size;
+    hdr->engine = config->engine;
+    hdr->large_threshold = config->large_threshold;
+    hdr->lock_mode = config->lock_mode;
+    hdr->buddy_cache_limit = config->buddy_cache_limit;
+
+    // A process sharing the heap may die holding its lock, which the others
+    // then have to notice
+    init_locks(hdr, shared ? HEAP_LOCK_ROBUST :
+                    config->latency_critical ? HEAP_LOCK_SPIN : HEAP_LOCK_SLEEP);
+
+    // Split the heap between the engines: a hybrid heap gives half to each.
+    // The bitmap buddy system keeps its bitmaps in front of its heap.
+    size_t buddy_heap_size;
+    if (config->engine == ALLOCATOR_ENGINE_BITMAP_BUDDY) {
+        hdr->bitmap_size = bitmap_buddy_layout(heap_size);
+    }
+    switch (config->engine) {
+        case ALLOCATOR_ENGINE_BUDDY:      buddy_heap_size = heap_size; break;
+        case ALLOCATOR_ENGINE_BITMAP_BUDDY: buddy_heap_size = heap_size - hdr->bitmap_size; break;
+        case ALLOCATOR_ENGINE_SEGREGATED: buddy_heap_size = 0; break;
+        default:                          buddy_heap_size = (heap_size / 2) & ~(size_t)(MIN_BLOCK_SIZE - 1); break;
+    }
+
+    hdr->buddy_heap = HEAP_HEADER_SIZE + hdr->bitmap_size;
+    hdr->buddy_heap_size = buddy_heap_size;
+    hdr->seg_heap = hdr->buddy_heap + buddy_heap_size;
+    hdr->seg_heap_size = heap_size - hdr->bitmap_size - buddy_heap_size;
+
+    attach_heap(a, base, mapping_size, shared);
+    if (config->engine == ALLOCATOR_ENGINE_BITMAP_BUDDY) {
+        bitmap_heap_init(a);
+    } else {
+        buddy_heap_init(a);
+    }
+    seg_heap_init(a);
+
+    hdr->total_free = heap_size - hdr->bitmap_size;
+    hdr->total_allocated = 0; // Initially nothing is allocated by the user
+
+    // Publish the heap last, so processes attaching concurrently never see
+    // a half-formatted header
+    __atomic_store_n(&hdr->magic, HEAP_MAGIC, __ATOMIC_RELEASE);
+}
+
+// Brings a latency-critical heap into its warm state: allocates config->warm's
+// blocks, all at once so each is split off fresh, then frees them onto the
+// free lists (and per-CPU caches) that later requests of the same sizes are
+// served from. Buddy blocks would merge again on free, so their orders' lazy
+// caches are made big enough to keep them split, and the bitmap buddy
+// engine keeps that many free blocks of each order from merging. Returns -1
+// if the heap can't hold them all.
+static int warm_heap(allocator_t* a, const allocator_config_t* config) {
+    // Chain the blocks through their first word while they're allocated
+    void* warm = NULL;
+    int failed = 0;
+    for (size_t i = 0; i < config->num_warm && !failed; i++) {
+        for (size_t n = 0; n < config->warm[i].count; n++) {
+            size_t size = config->warm[i].size < sizeof(void*) ? sizeof(void*) : config->warm[i].size;
+            void* ptr = allocator_malloc_tagged(a, size, 0);
+            if (!ptr) {
+                fprintf(stderr, "Heap too small for %zu warm blocks of %zu bytes\n",
+                        config->warm[i].count, config->warm[i].size);
+                failed = 1;
+                break;
+            }
+            if ((char*)ptr >= (char*)a->buddy_heap &&
+                (char*)ptr < (char*)a->buddy_heap + a->buddy_heap_size) {
+                // Bitmap buddy blocks are 2^(order + 4) bytes, with no header
+                int order = a->hdr->engine == ALLOCATOR_ENGINE_BITMAP_BUDDY
+                                ? __builtin_ctzl(bitmap_usable_size(a, ptr)) - 4
+                                : ((buddy_node_t*)((char*)ptr - sizeof(buddy_node_t)))->order;
+                a->buddy_warm[order]++;
+            }
+            *(void**)ptr = warm;
+            warm = ptr;
+        }
+    }
+
+    while (warm) {
+        void* next = *(void**)warm;
+        allocator_free(a, warm);
+        warm = next;
+    }
+    return failed ? -1 : 0;
+}
+
+// Maps a private heap for an instance
+static int create_private_heap(allocator_t* a, const allocator_config_t* config) {
+    allocator_config_t resolved = resolve_config(config);
+    size_t mapping_size = HEAP_HEADER_SIZE + resolved.heap_size;
+
+    // Allocate main heap using mmap. A latency-critical heap is faulted in
+    // now rather than page by page on first touch.
+    int flags = MAP_PRIVATE | MAP_ANONYMOUS;
+    if (resolved.latency_critical) flags |= MAP_POPULATE;
+    void* base = mmap(NULL, mapping_size,
+                      PROT_READ | PROT_WRITE,
+                      flags, -1, 0);
+
+    if (base == MAP_FAILED) {
         perror("mmap failed");
         return -1;
     }
-    
-    g_allocator.heap_end = (char*)g_allocator.heap_start + HEAP_SIZE;
-    
-    // Initialize buddy system heap (use half of total heap)
-    g_allocator.buddy_heap = g_allocator.heap_start;
-    g_allocator.buddy_heap_size = HEAP_SIZE / 2;
-    
-    // Create initial buddy block
-    // The initial block for the buddy system covers its entire allocated sub-heap.
-    // Its order is determined by the largest power of 2 that fits its size,
-    // ensuring it's a valid starting point for splits.
-    buddy_node_t* initial_buddy_block = (buddy_node_t*)g_allocator.buddy_heap;
-    initial_buddy_block->order = get_order(g_allocator.buddy_heap_size);
-    // Ensure the initial buddy block size is a power of 2 and aligns with HEAP_SIZE / 2
-    size_t actual_buddy_block_size = (1UL << (initial_buddy_block->order + 4));
-    assert(actual_buddy_block_size >= g_allocator.buddy_heap_size / 2); // Should cover at least half
-    
-    initial_buddy_block->free = 1;
-    initial_buddy_block->next = NULL;
-    initial_buddy_block->prev = NULL;
-    
-    g_allocator.buddy_free_lists[initial_buddy_block->order] = initial_buddy_block;
-    
-    // Initialize segregated list heap (use other half)
-    void* seg_heap_start = (char*)g_allocator.heap_start + HEAP_SIZE / 2;
-    size_t seg_heap_size = HEAP_SIZE / 2;
-    
-    // Create initial free block for segregated lists
-    block_t* initial_seg_block = (block_t*)seg_heap_start;
-    initial_seg_block->size = seg_heap_size; // The initial seg block takes up the entire second half
-    initial_seg_block->free = 1;
-    initial_seg_block->next = NULL;
-    initial_seg_block->prev = NULL;
-    
-    // Add to appropriate size class (this initial block will likely be in the largest size class)
-    size_t class_idx = get_size_class_index(seg_heap_size);
-    if (class_idx >= NUM_SIZE_CLASSES) class_idx = NUM_SIZE_CLASSES - 1; // Cap at max class
-    g_allocator.size_classes[class_idx] = initial_seg_block;
-    
-    g_allocator.total_free = HEAP_SIZE;
-    g_allocator.total_allocated = 0; // Initially nothing is allocated by the user
-    g_allocator.allocation_count = 0;
-    g_allocator.free_count = 0;
-    g_allocator.fragmentation_count = 0;
+    if (resolved.latency_critical && resolved.mlock_heap && mlock(base, mapping_size) == -1) {
+        perror("mlock failed for latency-critical heap");
+        munmap(base, mapping_size);
+        return -1;
+    }
+
+    a->latency_critical = resolved.latency_critical; // Decides how free blocks are listed
+    format_heap(a, base, mapping_size, &resolved, 0);
+    a->latency_classes = a->latency_critical ? seg_served_classes(a) : 0;
+
+    // Caches are per process, so only private heaps get them
+    if (percpu_cache_init(a, resolved.percpu_cache_limit) != 0) {
+        munmap(base, mapping_size);
+        return -1;
+    }
+
+    if (a->latency_critical) {
+        if (a->percpu_base && resolved.mlock_heap && mlock(a->percpu_base, a->percpu_size) == -1) {
+            perror("mlock failed for per-CPU caches");
+            percpu_cache_release(a);
+            munmap(base, mapping_size);
+            return -1;
+        }
+        if (warm_heap(a, &resolved) != 0) {
+            percpu_cache_release(a);
+            munmap(base, mapping_size);
+            return -1;
+        }
+        return 0; // Never sampled: the guarded pool maps and protects pages
+    }
+
+    // Instances created while guarded sampling is on take part in it
+    a->guarded = guarded_pool_acquire(a);
+    return 0;
+}
+
+// Initialize the memory allocator
+int allocator_init() {
+    return allocator_init_config(NULL);
+}
+
+// Initialize the default instance with a configuration
+int allocator_init_config(const allocator_config_t* config) {
+    if (create_private_heap(&g_allocator, config) != 0) {
+        return -1;
+    }
+    if (g_allocator.latency_critical) return 0; // Kept off stdio entirely
 
     printf("Memory allocator initialized:\n");
-    printf("  Total heap size: %zu bytes\n", (size_t)HEAP_SIZE);
-    printf("  Buddy system heap: %zu bytes\n", g_allocator.buddy_heap_size);
-    printf("  Segregated lists heap: %zu bytes\n", seg_heap_size);
-    
+    printf("  Total heap size: %zu bytes\n", g_allocator.hdr->heap_size - HEAP_HEADER_SIZE);
+    printf("  Buddy system heap: %zu bytes\n", g_allocator.hdr->buddy_heap_size);
+    if (g_allocator.hdr->bitmap_size) {
+        printf("  Buddy system bitmaps: %zu bytes\n", g_allocator.hdr->bitmap_size);
+    }
+    printf("  Segregated lists heap: %zu bytes\n", g_allocator.hdr->seg_heap_size);
+
     return 0;
 }
 
-// Public allocation interface
-void* my_malloc(size_t size) {
-    if (size == 0) return NULL;
-    
+// Creates an independent allocator instance
+allocator_t* allocator_create(const allocator_config_t* config) {
+    allocator_t* a = (allocator_t*)calloc(1, sizeof(allocator_t));
+    if (!a) return NULL;
+
+    if (create_private_heap(a, config) != 0) {
+        free(a);
+        return NULL;
+    }
+    return a;
+}
+
+// Unmaps an instance's heap and resets its view
+static void release_heap(allocator_t* a) {
+    if (!a->heap_start) return;
+
+    // A persistent heap is marked clean only once it is safely on disk
+    if (a->persistent && allocator_sync() == 0) {
+        a->hdr->dirty = 0;
+        allocator_sync();
+    }
+
+    percpu_cache_release(a);
+    if (a->guarded) guarded_pool_release(a);
+
+    // A shared heap stays intact for the other processes mapping it
+    size_t mapping_size = (size_t)((char*)a->heap_end - (char*)a->heap_start);
+    if (munmap(a->heap_start, mapping_size) == -1) {
+        perror("munmap failed during cleanup");
+    }
+    memset(a, 0, sizeof(*a)); // Reset allocator state
+}
+
+// Releases an instance and everything allocated from it
+void allocator_destroy(allocator_t* a) {
+    if (!a) return;
+    release_heap(a);
+    free(a);
+}
+
+// Initialize the allocator on a shared memory file descriptor
+int allocator_init_shared_fd(int fd, int create, const allocator_config_t* config) {
+    allocator_t* a = &g_allocator;
+    allocator_config_t resolved = resolve_config(create ? config : NULL);
+    size_t mapping_size = HEAP_HEADER_SIZE + resolved.heap_size;
+
+    // Per-CPU caches and prefaulting are per process
+    if (create && (resolved.percpu_cache_limit || resolved.latency_critical)) {
+        fprintf(stderr, "Per-CPU caches and latency-critical mode need a private heap\n");
+        return -1;
+    }
+
+    if (create) {
+        if (ftruncate(fd, (off_t)mapping_size) == -1) {
+            perror("ftruncate failed for shared heap");
+            return -1;
+        }
+    } else {
+        // Attach to a heap of whatever size it was created with, as
+        // recorded in its header
+        heap_header_t stored;
+        struct stat st;
+        if (pread(fd, &stored, sizeof(stored), 0) != (ssize_t)sizeof(stored) ||
+            fstat(fd, &st) == -1 || stored.heap_size < HEAP_HEADER_SIZE ||
+            (size_t)st.st_size < stored.heap_size) {
+            fprintf(stderr, "Shared heap is not formatted by this allocator\n");
+            return -1;
+        }
+        mapping_size = stored.heap_size;
+    }
+
+    void* base = mmap(NULL, mapping_size,
+                      PROT_READ | PROT_WRITE,
+                      MAP_SHARED, fd, 0);
+
+    if (base == MAP_FAILED) {
+        perror("mmap failed for shared heap");
+        return -1;
+    }
+
+    if (create) {
+        // Processes sharing the heap always need a lock between them
+        resolved.lock_mode = ALLOCATOR_LOCK_GLOBAL;
+        format_heap(a, base, mapping_size, &resolved, 1);
+        return 0;
+    }
+
+    heap_header_t* hdr = (heap_header_t*)base;
+    if (__atomic_load_n(&hdr->magic, __ATOMIC_ACQUIRE) != HEAP_MAGIC ||
+        hdr->version != HEAP_VERSION ||
+        hdr->heap_size != mapping_size) {
+        fprintf(stderr, "Shared heap is not formatted by this allocator\n");
+        munmap(base, mapping_size);
+        return -1;
+    }
+    attach_heap(a, base, mapping_size, 1);
+    return 0;
+}
+
+// Initialize the allocator on a named POSIX shared memory object
+int allocator_init_shared(const char* name, int create, const allocator_config_t* config) {
+    int fd = shm_open(name, O_RDWR | (create ? O_CREAT | O_TRUNC : 0), 0600);
+    if (fd == -1) {
+        perror("shm_open failed");
+        return -1;
+    }
+
+    // The mapping keeps the object alive; the descriptor isn't needed afterwards
+    int result = allocator_init_shared_fd(fd, create, config);
+    close(fd);
+    return result;
+}
+
+// Opens a persistent heap backed by 'path', creating it laid out by 'config'
+// if the file is new
+int allocator_open_file(const char* path, const allocator_config_t* config) {
+    int fd = open(path, O_RDWR | O_CREAT, 0600);
+    if (fd == -1) {
+        perror("open failed for heap file");
+        return -1;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) == -1) {
+        perror("fstat failed for heap file");
+        close(fd);
+        return -1;
+    }
+
+    // Reopening is just a mapping of the file, at the size stored in its
+    // header: the free lists, counters and root are already in place,
+    // stored as offsets
+    int create = st.st_size == 0;
+    int result = allocator_init_shared_fd(fd, create, config);
+    close(fd);
+    if (result != 0) return -1;
+
+    heap_header_t* hdr = g_allocator.hdr;
+    if (!create) {
+        // A persistent heap has a single owner, so a lock still held was
+        // left behind by an owner that died in the middle of an operation
+        init_locks(hdr, HEAP_LOCK_ROBUST);
+
+        // Walking the whole heap is only worth it if the last owner died
+        // mid-operation; otherwise checking the free lists is enough
+        int problems = heap_check(&g_allocator, hdr->dirty);
+        if (problems) {
+            fprintf(stderr, "Heap file %s failed consistency check (%d problems)%s\n",
+                    path, problems, hdr->dirty ? ", it was not closed cleanly" : "");
+            allocator_cleanup();
+            return -1;
+        }
+    }
+
+    hdr->dirty = 1;
+    g_allocator.persistent = 1;
+    return 0;
+}
+
+// Flushes a persistent heap to its file
+int allocator_sync(void) {
+    if (!g_allocator.persistent) return 0;
+
+    size_t mapping_size = (size_t)((char*)g_allocator.heap_end - (char*)g_allocator.heap_start);
+    if (msync(g_allocator.heap_start, mapping_size, MS_SYNC) == -1) {
+        perror("msync failed for heap file");
+        return -1;
+    }
+    return 0;
+}
+
+// Root allocation of a persistent heap, found again after reopening
+void allocator_set_root(void* ptr) {
+    g_allocator.hdr->root = HEAP_OFF(&g_allocator, ptr);
+}
+
+void* allocator_get_root(void) {
+    return HEAP_PTR(&g_allocator, g_allocator.hdr->root);
+}
+
+// Counts inconsistencies in the heap. The free lists are always checked;
+// 'full' also walks every segregated block and cross-checks the counters.
+int heap_check(allocator_t* a, int full) {
+    heap_header_t* hdr = a->hdr;
+    int problems = 0;
+
+    if (hdr->buddy_heap != HEAP_HEADER_SIZE + hdr->bitmap_size ||
+        hdr->buddy_heap_size + hdr->seg_heap_size + hdr->buddy_heap != hdr->heap_size ||
+        hdr->seg_heap != hdr->buddy_heap + hdr->buddy_heap_size) {
+        return 1; // Layout itself is broken, nothing else can be trusted
+    }
+
+    // Every buddy free block must be inside the buddy heap, aligned to its
+    // size, marked free, and linked consistently. The walk is bounded in
+    // case a list has become circular.
+    size_t max_blocks = hdr->heap_size / MIN_BLOCK_SIZE;
+    for (int i = 0; i < MAX_ORDER; i++) {
+        heap_off_t prev = 0;
+        heap_off_t off = hdr->buddy_free_lists[i];
+        size_t steps = 0;
+        while (off && steps++ < max_blocks) {
+            size_t rel = off - hdr->buddy_heap;
+            size_t block_size = 1UL << (i + 4);
+            if (off < hdr->buddy_heap || rel + block_size > hdr->buddy_heap_size ||
+                rel % block_size != 0) {
+                problems++;
+                break;
+            }
+            buddy_node_t* node = (buddy_node_t*)HEAP_PTR(a, off);
+            if (!node->free || node->order != i || node->prev != prev) {
+                problems++;
+            }
+            prev = off;
+            off = node->next;
+        }
+        if (off) problems++; // Walk didn't terminate
+
+        // Blocks held back by lazy coalescing: same checks, and the count
+        // has to match the cache
+        size_t cached = 0;
+        off = hdr->buddy_cache[i];
+        while (off && cached < max_blocks) {
+            size_t rel = off - hdr->buddy_heap;
+            size_t block_size = 1UL << (i + 4);
+            if (off < hdr->buddy_heap || rel + block_size > hdr->buddy_heap_size ||
+                rel % block_size != 0) {
+                problems++;
+                break;
+            }
+            buddy_node_t* node = (buddy_node_t*)HEAP_PTR(a, off);
+            if (node->free != BUDDY_CACHED || node->order != i) {
+                problems++;
+            }
+            cached++;
+            off = node->next;
+        }
+        if (off || cached != hdr->buddy_cache_count[i]) problems++;
+    }
+
+    // The bitmap buddy system keeps no lists, only its bitmaps
+    if (hdr->engine == ALLOCATOR_ENGINE_BITMAP_BUDDY) {
+        problems += bitmap_check(a);
+    }
+
+    // Same for the segregated lists, against the segregated heap
+    for (int i = 0; i < NUM_LIFETIMES * NUM_SIZE_CLASSES; i++) {
+        heap_off_t prev = 0;
+        heap_off_t off = hdr->size_classes[i / NUM_SIZE_CLASSES][i % NUM_SIZE_CLASSES];
+        size_t steps = 0;
+        while (off && steps++ < max_blocks) {
+            block_t* block = (block_t*)HEAP_PTR(a, off);
+            if (off < hdr->seg_heap || off + sizeof(block_t) > hdr->heap_size ||
+                block->size < sizeof(block_t) || off + block->size > hdr->heap_size) {
+                problems++;
+                break;
+            }
+            if (!block->free || block->prev != prev ||
+                block->lifetime != (int)(i / NUM_SIZE_CLASSES)) {
+                problems++;
+            }
+            prev = off;
+            off = block->next;
+        }
+        if (off) problems++;
+    }
+
+    problems += handle_check(a);
+    if (!full) return problems;
+
+    // Segregated blocks tile their heap exactly, so walk them by size and
+    // make sure the walk lands on the end of the heap
+    size_t seg_allocated = 0;
+    heap_off_t off = hdr->seg_heap;
+    while (hdr->seg_heap_size >= sizeof(block_t) + MIN_BLOCK_SIZE && off < hdr->heap_size) {
+        block_t* block = (block_t*)HEAP_PTR(a, off);
+        if (block->size < sizeof(block_t) || off + block->size > hdr->heap_size) {
+            problems++;
+            break;
+        }
+        if (block->free != 1) seg_allocated += block->size;
+        off += block->size;
+    }
+
+    allocator_stats_t counters;
+    heap_read_counters(a, &counters);
+    if (hdr->total_allocated + hdr->total_free != hdr->heap_size - hdr->buddy_heap ||
+        seg_allocated > counters.allocated_bytes) {
+        problems++;
+    }
+    return problems;
+}
+
+// Runs a full consistency check of the heap
+int allocator_check_heap(void) {
+    lock_heap(&g_allocator);
+    int problems = heap_check(&g_allocator, 1);
+    unlock_heap(&g_allocator);
+    return problems;
+}
+
+// Offset/pointer conversion for handing allocations to other processes
+size_t allocator_ptr_to_offset(const void* ptr) {
+    return HEAP_OFF(&g_allocator, ptr);
+}
+
+void* allocator_offset_to_ptr(size_t offset) {
+    return HEAP_PTR(&g_allocator, offset);
+}
+
+// Enables or disables sampled guard-page checking
+int allocator_enable_guarded_sampling(unsigned int sample_rate) {
+    if (guarded_pool_init(sample_rate) != 0) {
+        return -1;
+    }
+    // Sampled blocks live outside the heap mapping, so they can't be handed
+    // to other processes: never sample from a shared heap. Latency-critical
+    // heaps aren't sampled either. Once taking part, the default instance
+    // keeps its reference to the pool until it's cleaned up: sampling being
+    // turned off only stops new samples.
+    if (g_allocator.heap_start && !g_allocator.guarded &&
+        !g_allocator.shared && !g_allocator.latency_critical) {
+        g_allocator.guarded = guarded_pool_acquire(&g_allocator);
+    }
+    return 0;
+}
+
+// Maps ALLOC_HINT_* flags to the lifetime class allocations are routed by
+static int hint_lifetime(unsigned int flags) {
+    if (flags & ALLOC_HINT_LONG_LIVED) return LIFETIME_LONG;
+    if (flags & (ALLOC_HINT_PER_REQUEST | ALLOC_HINT_TRANSIENT)) return LIFETIME_REQUEST;
+    return LIFETIME_GENERAL;
+}
+
+// Picks the engine for an allocation
+void* heap_alloc(allocator_t* a, size_t size, int lifetime) {
+    switch (a->hdr->engine) {
+        case ALLOCATOR_ENGINE_BUDDY:      return buddy_alloc_internal(a, size, lifetime);
+        case ALLOCATOR_ENGINE_SEGREGATED: return seg_alloc_internal(a, size, lifetime);
+        case ALLOCATOR_ENGINE_BITMAP_BUDDY: return bitmap_alloc_internal(a, size, lifetime);
+        default: break;
+    }
+
     // Use buddy system for larger allocations, segregated lists for smaller ones
-    // The threshold (4096 bytes) can be tuned.
-    if (size > 4096 - sizeof(buddy_node_t)) { // Account for header size
-        return buddy_alloc_internal(size);
+    // The threshold (4096 bytes by default) is set per heap.
+    if (size > a->hdr->large_threshold - sizeof(buddy_node_t)) { // Account for header size
+        return buddy_alloc_internal(a, size, lifetime);
     } else {
-        void* ptr = seg_alloc_internal(size);
+        void* ptr = seg_alloc_internal(a, size, lifetime);
         if (!ptr) {
             // Fallback to buddy system if segregated list fails (e.g., no suitable block)
             // This might lead to more fragmentation for smaller blocks if the seg list is exhausted.
             // A more sophisticated allocator might try to get a larger block from buddy and
             // then split it for the segregated list.
-            ptr = buddy_alloc_internal(size); // Note: buddy_alloc might return a larger block than requested
+            ptr = buddy_alloc_internal(a, size, lifetime); // Note: buddy_alloc might return a larger block than requested
         }
         return ptr;
     }
 }
 
-void my_free(void* ptr) {
+// Allocations the calling thread has left until its next sampled one, 0
+// until it first allocates from a sampled instance. Per thread, so threads
+// sharing an instance don't all write one counter on every allocation.
+static __thread size_t g_guard_countdown;
+
+// Counts down to the next sampled allocation. Returns 1 if this allocation
+// should be sampled.
+static int guard_tick(void) {
+    if (g_guard_countdown == 0) {
+        g_guard_countdown = guarded_sample_interval(); // Stays 0 once sampling is off
+        return 0;
+    }
+    if (--g_guard_countdown != 0) return 0;
+
+    g_guard_countdown = guarded_sample_interval();
+    return 1;
+}
+
+// Current tag of each thread, charged for allocations made without one
+static __thread unsigned int g_thread_tag;
+
+unsigned int allocator_set_thread_tag(unsigned int tag) {
+    unsigned int previous = g_thread_tag;
+
+    if (tag >= ALLOCATOR_MAX_TAGS) {
+        fprintf(stderr, "Allocation tag %u out of range (max %d)\n", tag, ALLOCATOR_MAX_TAGS - 1);
+        assert(0 && "Allocation tag out of range");
+        return previous;
+    }
+    g_thread_tag = tag;
+    return previous;
+}
+
+// Where an allocated block's tag is kept: in its header, in the bitmap
+// buddy system's tag table, or in its guarded pool slot. Returns the tag
+// stored, which is 0 if the bitmap buddy system had no room for its table.
+static unsigned int set_block_tag(allocator_t* a, void* ptr, unsigned int tag) {
+    if ((char*)ptr >= (char*)a->buddy_heap &&
+        (char*)ptr < (char*)a->buddy_heap + a->buddy_heap_size) {
+        if (a->hdr->engine == ALLOCATOR_ENGINE_BITMAP_BUDDY) {
+            return bitmap_set_tag(a, ptr, tag);
+        } else {
+            ((buddy_node_t*)((char*)ptr - sizeof(buddy_node_t)))->tag = (uint16_t)tag;
+        }
+    } else if ((char*)ptr >= g_guarded_pool.start && (char*)ptr < g_guarded_pool.end) {
+        guarded_set_tag(ptr, tag);
+    } else {
+        ((block_t*)((char*)ptr - sizeof(block_t)))->tag = (uint16_t)tag;
+    }
+    return tag;
+}
+
+static unsigned int block_tag(allocator_t* a, void* ptr) {
+    if ((char*)ptr >= (char*)a->buddy_heap &&
+        (char*)ptr < (char*)a->buddy_heap + a->buddy_heap_size) {
+        if (a->hdr->engine == ALLOCATOR_ENGINE_BITMAP_BUDDY) {
+            return bitmap_tag(a, ptr);
+        }
+        return ((buddy_node_t*)((char*)ptr - sizeof(buddy_node_t)))->tag;
+    } else if ((char*)ptr >= g_guarded_pool.start && (char*)ptr < g_guarded_pool.end) {
+        return guarded_tag(ptr);
+    }
+    return ((block_t*)((char*)ptr - sizeof(block_t)))->tag;
+}
+
+// Bytes an allocated block is charged to its tag: the whole block, header
+// included, like the heap's own counters
+static size_t block_footprint(allocator_t* a, void* ptr) {
+    if ((char*)ptr >= (char*)a->buddy_heap &&
+        (char*)ptr < (char*)a->buddy_heap + a->buddy_heap_size) {
+        if (a->hdr->engine == ALLOCATOR_ENGINE_BITMAP_BUDDY) {
+            return bitmap_usable_size(a, ptr);
+        }
+        return 1UL << (((buddy_node_t*)((char*)ptr - sizeof(buddy_node_t)))->order + 4);
+    } else if ((char*)ptr >= g_guarded_pool.start && (char*)ptr < g_guarded_pool.end) {
+        return guarded_usable_size(ptr);
+    }
+    return ((block_t*)((char*)ptr - sizeof(block_t)))->size;
+}
+
+// Stores a new block's tag and charges it. Untagged blocks only cost the
+// store. Caller holds the global lock, if the heap has one.
+static void tag_block(allocator_t* a, void* ptr, unsigned int tag) {
+    tag = set_block_tag(a, ptr, tag);
+    if (tag) {
+        heap_count_tag_alloc(a, tag, block_footprint(a, ptr));
+    }
+}
+
+// Credits a block's tag back before it's freed. The caller has already
+// worked out which engine the block belongs to, so it reads the tag. Caller
+// holds the global lock, if the heap has one.
+static void untag_block(allocator_t* a, void* ptr, unsigned int tag) {
+    if (tag) {
+        heap_count_tag_free(a, tag, block_footprint(a, ptr));
+    }
+}
+
+// Allocates a block with lifetime hints 'flags', charged to 'tag'
+static void* heap_malloc(allocator_t* a, size_t size, unsigned int flags, unsigned int tag) {
+    if (size == 0) return NULL;
+
+    if (tag >= ALLOCATOR_MAX_TAGS) {
+        fprintf(stderr, "Allocation tag %u out of range (max %d)\n", tag, ALLOCATOR_MAX_TAGS - 1);
+        assert(0 && "Allocation tag out of range");
+        return NULL;
+    }
+
+    int global = a->lock_mode == ALLOCATOR_LOCK_GLOBAL;
+
+    // Sampled guard-page allocation. When sampling is off this costs a
+    // single branch on the normal path.
+    if (a->guarded && guard_tick()) {
+        void* ptr = guarded_alloc_internal(a, size);
+        if (ptr) {
+            if (global) heap_lock(&a->hdr->lock);
+            tag_block(a, ptr, tag);
+            if (global) heap_unlock(&a->hdr->lock);
+            return ptr;
+        }
+    }
+
+    int lifetime = hint_lifetime(flags);
+
+    // Per-CPU cache, for general allocations of the cached size classes.
+    // Requests are rounded up to their class, so that any cached block of
+    // the class fits them; a miss allocates the rounded size from the lists.
+    if (a->percpu_base && lifetime == LIFETIME_GENERAL &&
+        size <= a->class_sizes[a->percpu_classes - 1]) {
+        size_t class_idx = get_size_class_index(a, size);
+        void* ptr = percpu_cache_pop(a, class_idx);
+        if (ptr) {
+            ((block_t*)((char*)ptr - sizeof(block_t)))->free = 0;
+            // Untagged blocks only need the store, not the lock
+            if (global && tag) heap_lock(&a->hdr->lock);
+            tag_block(a, ptr, tag);
+            if (global && tag) heap_unlock(&a->hdr->lock);
+            return ptr;
+        }
+        size = a->class_sizes[class_idx];
+    } else if (a->latency_classes &&
+               size + sizeof(block_t) <= a->class_sizes[a->latency_classes - 1]) {
+        // Latency-critical heaps round the block, header included, up to its
+        // class. Blocks are listed by the class size they cover, so the
+        // first block on the class's list fits.
+        size = a->class_sizes[get_size_class_index(a, size + sizeof(block_t))] - sizeof(block_t);
+    }
+
+    // Other threads or processes may be allocating at the same time. With
+    // fine-grained locking the engines lock the lists they touch themselves.
+    if (global) heap_lock(&a->hdr->lock);
+    void* ptr = heap_alloc(a, size, lifetime);
+    if (ptr) tag_block(a, ptr, tag);
+    if (global) heap_unlock(&a->hdr->lock);
+
+    // Blocks sitting in any CPU's caches may be what the heap is missing
+    if (!ptr && a->percpu_base && percpu_cache_drain(a) > 0) {
+        if (global) heap_lock(&a->hdr->lock);
+        ptr = heap_alloc(a, size, lifetime);
+        if (ptr) tag_block(a, ptr, tag);
+        if (global) heap_unlock(&a->hdr->lock);
+    }
+    return ptr;
+}
+
+// Instance allocation interface
+void* allocator_malloc_hint(allocator_t* a, size_t size, unsigned int flags) {
+    return heap_malloc(a, size, flags, g_thread_tag);
+}
+
+void* allocator_malloc_tagged(allocator_t* a, size_t size, unsigned int tag) {
+    return heap_malloc(a, size, ALLOC_HINT_NONE, tag);
+}
+
+void* allocator_malloc(allocator_t* a, size_t size) {
+    return heap_malloc(a, size, ALLOC_HINT_NONE, g_thread_tag);
+}
+
+void allocator_free(allocator_t* a, void* ptr) {
     if (!ptr) return;
-    
-    // Determine which allocator was used based on address
-    // The buddy heap starts at g_allocator.heap_start and occupies buddy_heap_size
+
+    // Determine which engine was used based on address
+    // The buddy heap starts right after the heap header and occupies buddy_heap_size
     // The segregated list heap starts after the buddy heap.
-    if (ptr >= g_allocator.buddy_heap && 
-        ptr < (char*)g_allocator.buddy_heap + g_allocator.buddy_heap_size) {
-        buddy_free_internal(ptr);
-    } else if (ptr > (char*)g_allocator.buddy_heap + g_allocator.buddy_heap_size &&
-               ptr < g_allocator.heap_end) {
-        seg_free_internal(ptr);
+    if ((char*)ptr >= (char*)a->buddy_heap &&
+        (char*)ptr < (char*)a->buddy_heap + a->buddy_heap_size) {
+        if (a->lock_mode == ALLOCATOR_LOCK_GLOBAL) heap_lock(&a->hdr->lock);
+        if (a->hdr->engine == ALLOCATOR_ENGINE_BITMAP_BUDDY) {
+            untag_block(a, ptr, bitmap_tag(a, ptr));
+            bitmap_free_internal(a, ptr);
+        } else {
+            untag_block(a, ptr, ((buddy_node_t*)((char*)ptr - sizeof(buddy_node_t)))->tag);
+            buddy_free_internal(a, ptr);
+        }
+        if (a->lock_mode == ALLOCATOR_LOCK_GLOBAL) heap_unlock(&a->hdr->lock);
+    } else if ((char*)ptr > (char*)a->seg_heap &&
+               (char*)ptr < (char*)a->heap_end) {
+        block_t* block = (block_t*)((char*)ptr - sizeof(block_t));
+
+        // Per-CPU cache first. The block stays allocated as far as the heap
+        // is concerned, so only its tag is credited. Its size and tag are
+        // read beforehand: once cached, another thread may take it. It is
+        // marked cached before the push, so freeing it again is caught below.
+        if (a->percpu_base && block->lifetime == LIFETIME_GENERAL && !block->free) {
+            size_t block_size = block->size;
+            unsigned int tag = block->tag;
+            block->free = SEG_CACHED;
+            if (percpu_cache_push(a, ptr, block_size)) {
+                if (tag) {
+                    if (a->lock_mode == ALLOCATOR_LOCK_GLOBAL) heap_lock(&a->hdr->lock);
+                    heap_count_tag_free(a, tag, block_size);
+                    if (a->lock_mode == ALLOCATOR_LOCK_GLOBAL) heap_unlock(&a->hdr->lock);
+                }
+                return;
+            }
+            block->free = 0;
+        }
+
+        if (a->lock_mode == ALLOCATOR_LOCK_GLOBAL) heap_lock(&a->hdr->lock);
+        untag_block(a, ptr, block->tag);
+        seg_free_internal(a, ptr);
+        if (a->lock_mode == ALLOCATOR_LOCK_GLOBAL) heap_unlock(&a->hdr->lock);
+    } else if ((char*)ptr >= g_guarded_pool.start && (char*)ptr < g_guarded_pool.end) {
+        if (a->lock_mode == ALLOCATOR_LOCK_GLOBAL) heap_lock(&a->hdr->lock);
+        untag_block(a, ptr, guarded_tag(ptr));
+        if (a->lock_mode == ALLOCATOR_LOCK_GLOBAL) heap_unlock(&a->hdr->lock);
+        guarded_free_internal(ptr);
     } else {
         // This indicates an attempt to free memory not allocated by this allocator
         fprintf(stderr, "Attempt to free unmanaged memory address: %p\n", ptr);
@@ -135,83 +856,278 @@ void my_free(void* ptr) {
     }
 }
 
+// Movable allocations. The handle table and the heap are updated under the
+// global lock, if the heap has one; with fine-grained locking the table has
+// its own lock. Pinning takes no lock.
+allocator_handle_t allocator_handle_alloc(allocator_t* a, size_t size) {
+    if (size == 0) return 0;
+
+    int global = a->lock_mode == ALLOCATOR_LOCK_GLOBAL;
+    allocator_handle_t handle = 0;
+
+    if (global) heap_lock(&a->hdr->lock);
+    long index = handle_reserve(a);
+    if (index >= 0) {
+        // Blocks that land in the segregated heap are the movable ones
+        void* ptr = heap_alloc(a, size, LIFETIME_GENERAL);
+        if (ptr) {
+            tag_block(a, ptr, g_thread_tag);
+            handle = handle_publish(a, (size_t)index, ptr);
+        } else {
+            handle_unreserve(a, (size_t)index);
+        }
+    }
+    if (global) heap_unlock(&a->hdr->lock);
+    return handle;
+}
+
+void allocator_handle_free(allocator_t* a, allocator_handle_t handle) {
+    if (!handle) return;
+
+    int global = a->lock_mode == ALLOCATOR_LOCK_GLOBAL;
+    size_t index;
+
+    if (global) heap_lock(&a->hdr->lock);
+    void* ptr = handle_claim_for_free(a, handle, &index);
+    if (ptr) {
+        // Straight to the engine: handle blocks never go on per-CPU caches
+        untag_block(a, ptr, block_tag(a, ptr));
+        if ((char*)ptr >= (char*)a->buddy_heap &&
+            (char*)ptr < (char*)a->buddy_heap + a->buddy_heap_size) {
+            if (a->hdr->engine == ALLOCATOR_ENGINE_BITMAP_BUDDY) {
+                bitmap_free_internal(a, ptr);
+            } else {
+                buddy_free_internal(a, ptr);
+            }
+        } else {
+            seg_free_internal(a, ptr);
+        }
+        handle_unreserve(a, index);
+    }
+    if (global) heap_unlock(&a->hdr->lock);
+}
+
+void* allocator_handle_pin(allocator_t* a, allocator_handle_t handle) {
+    return handle_pin_internal(a, handle);
+}
+
+void allocator_handle_unpin(allocator_t* a, allocator_handle_t handle) {
+    handle_unpin_internal(a, handle);
+}
+
+// One bounded compaction step of the segregated heap
+size_t allocator_compact(allocator_t* a, size_t max_bytes, int* done) {
+    int pass_done;
+    if (a->lock_mode == ALLOCATOR_LOCK_GLOBAL) heap_lock(&a->hdr->lock);
+    size_t moved = seg_compact(a, max_bytes, &pass_done);
+    if (a->lock_mode == ALLOCATOR_LOCK_GLOBAL) heap_unlock(&a->hdr->lock);
+    if (done) *done = pass_done;
+    return moved;
+}
+
 // Realloc implementation
-void* my_realloc(void* ptr, size_t new_size) {
-    if (!ptr) return my_malloc(new_size);
+void* allocator_realloc(allocator_t* a, void* ptr, size_t new_size) {
+    if (!ptr) return allocator_malloc(a, new_size);
     if (new_size == 0) {
-        my_free(ptr);
+        allocator_free(a, ptr);
         return NULL;
     }
-    
+
     // In a real realloc, you'd need to know the *original* size of the block
     // pointed to by `ptr`. Since our block headers are *before* the user data,
     // we can attempt to retrieve the size.
     size_t old_size;
-    
-    // Determine which allocator was used to get old_size
-    if (ptr >= g_allocator.buddy_heap && 
-        ptr < (char*)g_allocator.buddy_heap + g_allocator.buddy_heap_size) {
+
+    // Determine which engine was used to get old_size
+    if ((char*)ptr >= (char*)a->buddy_heap &&
+        (char*)ptr < (char*)a->buddy_heap + a->buddy_heap_size &&
+        a->hdr->engine == ALLOCATOR_ENGINE_BITMAP_BUDDY) {
+        old_size = bitmap_usable_size(a, ptr); // No header, the whole block is payload
+    } else if ((char*)ptr >= (char*)a->buddy_heap &&
+               (char*)ptr < (char*)a->buddy_heap + a->buddy_heap_size) {
         buddy_node_t* block = (buddy_node_t*)((char*)ptr - sizeof(buddy_node_t));
         old_size = (1UL << (block->order + 4)) - sizeof(buddy_node_t); // Payload size
+    } else if ((char*)ptr >= g_guarded_pool.start && (char*)ptr < g_guarded_pool.end) {
+        old_size = guarded_usable_size(ptr);
     } else {
         block_t* block = (block_t*)((char*)ptr - sizeof(block_t));
         old_size = block->size - sizeof(block_t); // Payload size
     }
 
-    void* new_ptr = my_malloc(new_size);
+    // The new block stays charged to the old one's tag
+    void* new_ptr = heap_malloc(a, new_size, ALLOC_HINT_NONE, block_tag(a, ptr));
     if (!new_ptr) return NULL;
-    
+
     // Copy old data, copying the minimum of the old and new payload size
     memcpy(new_ptr, ptr, (old_size < new_size) ? old_size : new_size);
-    my_free(ptr);
-    
+    allocator_free(a, ptr);
+
     return new_ptr;
 }
 
+// Public allocation interface, on the default instance
+void* my_malloc(size_t size) {
+    return allocator_malloc(&g_allocator, size);
+}
+
+void* my_malloc_hint(size_t size, unsigned int flags) {
+    return allocator_malloc_hint(&g_allocator, size, flags);
+}
+
+void* my_malloc_tagged(size_t size, unsigned int tag) {
+    return allocator_malloc_tagged(&g_allocator, size, tag);
+}
+
+void my_free(void* ptr) {
+    allocator_free(&g_allocator, ptr);
+}
+
+void* my_realloc(void* ptr, size_t new_size) {
+    return allocator_realloc(&g_allocator, ptr, new_size);
+}
+
 // Statistics and debugging
-void print_allocator_stats() {
+void allocator_print_stats(allocator_t* a) {
+    heap_header_t* hdr = a->hdr;
+    allocator_stats_t counters;
+
+    lock_heap(a);
+    heap_read_counters(a, &counters);
+
     printf("\n=== Memory Allocator Statistics ===\n");
-    printf("Total allocations: %zu\n", g_allocator.allocation_count);
-    printf("Total frees: %zu\n", g_allocator.free_count);
-    printf("Currently allocated: %zu bytes\n", g_allocator.total_allocated);
-    printf("Currently free: %zu bytes\n", g_allocator.total_free);
-    printf("Fragmentation events: %zu\n", g_allocator.fragmentation_count);
-    
+    printf("Total allocations: %zu\n", counters.allocation_count);
+    printf("Total frees: %zu\n", counters.free_count);
+    printf("Currently allocated: %zu bytes\n", counters.allocated_bytes);
+    printf("Currently free: %zu bytes\n", counters.free_bytes);
+    printf("Fragmentation events: %zu\n", hdr->fragmentation_count);
+    if (a->percpu_base) {
+        printf("Held in per-CPU caches: %zu bytes\n", percpu_cached_bytes(a));
+    }
+    if (g_guarded_pool.start) {
+        printf("Guarded samples: %zu (%zu live)\n",
+               g_guarded_pool.sampled_count, g_guarded_pool.live_count);
+    }
+
     printf("\nBuddy System Free Lists:\n");
     for (int i = 0; i < MAX_ORDER; i++) {
         int count = 0;
-        buddy_node_t* block = g_allocator.buddy_free_lists[i];
+        buddy_node_t* block = (buddy_node_t*)HEAP_PTR(a, hdr->buddy_free_lists[i]);
         while (block) {
             count++;
-            block = block->next;
+            block = (buddy_node_t*)HEAP_PTR(a, block->next);
+        }
+        if (hdr->bitmap_count[i] > 0) {
+            printf("  Order %d (block size %zu bytes, no header): %zu blocks\n",
+                     i, (1UL << (i + 4)), hdr->bitmap_count[i]);
         }
         if (count > 0) {
-            printf("  Order %d (block size %zu bytes, payload %zu bytes): %d blocks\n", 
+            printf("  Order %d (block size %zu bytes, payload %zu bytes): %d blocks\n",
                      i, (1UL << (i + 4)), (1UL << (i + 4)) - sizeof(buddy_node_t), count);
         }
+        if (hdr->buddy_cache_count[i] > 0) {
+            printf("  Order %d (block size %zu bytes): %zu blocks cached, not yet merged\n",
+                     i, (1UL << (i + 4)), hdr->buddy_cache_count[i]);
+        }
     }
-    
+
+    static const char* lifetime_names[NUM_LIFETIMES] = {"", " [long-lived]", " [per-request]"};
     printf("\nSegregated Free Lists:\n");
-    for (int i = 0; i < NUM_SIZE_CLASSES; i++) {
-        int count = 0;
-        block_t* block = g_allocator.size_classes[i];
-        while (block) {
-            count++;
-            block = block->next;
+    for (int l = 0; l < NUM_LIFETIMES; l++) {
+        for (int i = 0; i < NUM_SIZE_CLASSES; i++) {
+            int count = 0;
+            block_t* block = (block_t*)HEAP_PTR(a, hdr->size_classes[l][i]);
+            while (block) {
+                count++;
+                block = (block_t*)HEAP_PTR(a, block->next);
+            }
+            if (count > 0) {
+                printf("  Size class index %d (target size %zu bytes)%s: %d blocks\n",
+                         i, a->class_sizes[i], lifetime_names[l], count);
+            }
         }
-        if (count > 0) {
-            printf("  Size class index %d (target size %zu bytes): %d blocks\n", 
-                     i, g_allocator.class_sizes[i], count);
+    }
+
+    allocator_tag_stats_t tags[ALLOCATOR_MAX_TAGS];
+    size_t num_tags = allocator_get_tag_stats(a, tags, ALLOCATOR_MAX_TAGS);
+    if (num_tags > 0) {
+        printf("\nAllocation Tags:\n");
+        for (size_t i = 0; i < num_tags; i++) {
+            printf("  Tag %u: %zu bytes live (peak %zu), %zu allocations, %zu frees\n",
+                   tags[i].tag, tags[i].live_bytes, tags[i].peak_bytes,
+                   tags[i].allocation_count, tags[i].free_count);
         }
     }
+
+    unlock_heap(a);
 }
 
-// Cleanup function
-void allocator_cleanup() {
-    if (g_allocator.heap_start) {
-        if (munmap(g_allocator.heap_start, HEAP_SIZE) == -1) {
-            perror("munmap failed during cleanup");
+// Fills in counters and a free-space summary of both engines
+void allocator_get_stats(allocator_t* a, allocator_stats_t* stats) {
+    if (!a) a = &g_allocator;
+    heap_header_t* hdr = a->hdr;
+
+    lock_heap(a);
+
+    memset(stats, 0, sizeof(*stats));
+    heap_read_counters(a, stats);
+    stats->cached_bytes = percpu_cached_bytes(a);
+
+    for (int i = 0; i < MAX_ORDER; i++) {
+        size_t block_size = 1UL << (i + 4);
+        for (buddy_node_t* block = (buddy_node_t*)HEAP_PTR(a, hdr->buddy_free_lists[i]); block;
+             block = (buddy_node_t*)HEAP_PTR(a, block->next)) {
+            stats->free_blocks++;
+            if (block_size > stats->largest_free_block) stats->largest_free_block = block_size;
+        }
+        if (hdr->buddy_cache_count[i] + hdr->bitmap_count[i] > 0) {
+            stats->free_blocks += hdr->buddy_cache_count[i] + hdr->bitmap_count[i];
+            if (block_size > stats->largest_free_block) stats->largest_free_block = block_size;
+        }
+    }
+    for (int l = 0; l < NUM_LIFETIMES; l++) {
+        for (int i = 0; i < NUM_SIZE_CLASSES; i++) {
+            for (block_t* block = (block_t*)HEAP_PTR(a, hdr->size_classes[l][i]); block;
+                 block = (block_t*)HEAP_PTR(a, block->next)) {
+                stats->free_blocks++;
+                if (block->size > stats->largest_free_block) stats->largest_free_block = block->size;
+            }
+        }
+    }
+
+    unlock_heap(a);
+}
+
+// Copies out the counters of every tag that has been used
+size_t allocator_get_tag_stats(allocator_t* a, allocator_tag_stats_t* stats, size_t max_stats) {
+    if (!a) a = &g_allocator;
+    size_t used = 0;
+
+    // Each counter is read atomically; with other threads running the set
+    // is a close snapshot, not an exact one
+    for (unsigned int tag = 1; tag < ALLOCATOR_MAX_TAGS; tag++) {
+        tag_counters_t* counters = &a->hdr->tags[tag];
+        size_t allocation_count = __atomic_load_n(&counters->allocation_count, __ATOMIC_RELAXED);
+        if (allocation_count == 0) continue;
+
+        if (used < max_stats) {
+            allocator_tag_stats_t* out = &stats[used];
+            out->tag = tag;
+            out->live_bytes = __atomic_load_n(&counters->live_bytes, __ATOMIC_RELAXED);
+            out->peak_bytes = __atomic_load_n(&counters->peak_bytes, __ATOMIC_RELAXED);
+            out->allocation_count = allocation_count;
+            out->free_count = __atomic_load_n(&counters->free_count, __ATOMIC_RELAXED);
         }
-        memset(&g_allocator, 0, sizeof(g_allocator)); // Reset allocator state
+        used++;
     }
-}
\ No newline at end of file
+    return used;
+}
+
+void print_allocator_stats() {
+    allocator_print_stats(&g_allocator);
+}
+
+// Cleanup function. Guarded sampling is process-wide and stays on for other
+// instances; only the default instance's sampled blocks are freed.
+void allocator_cleanup() {
+    release_heap(&g_allocator);
+}
@@ -3,43 +3,153 @@
 
 #include <stddef.h> // For size_t
 #include <stdint.h> // For uintptr_t
+#include "memory_allocator.h" // For allocator_config_t and the allocator_t tag
 
 // Configuration constants
-#define HEAP_SIZE (1024 * 1024)     // 1MB heap
+#define HEAP_SIZE (1024 * 1024)     // Default heap size (1MB)
+#define LARGE_THRESHOLD 4096        // Default size above which hybrid heaps use the buddy system
 #define MIN_BLOCK_SIZE 16           // Minimum allocation size
 #define MAX_ORDER 20                // Maximum buddy system order
 #define NUM_SIZE_CLASSES 12         // Number of segregated list size classes
+#define NUM_LIFETIMES 3             // Segregated list sets: general, long-lived, short-lived
+#define SEG_SPAN_SIZE (16 * 1024)   // Space a hinted lifetime takes from the general lists at a time
+#define GUARDED_POOL_SLOTS 64       // Number of page-sized slots in the guarded pool
+#define GUARDED_STACK_DEPTH 16      // Frames recorded for guarded allocation/free stacks
+#define CACHE_LINE_SIZE 64          // Lock words and counter stripes are padded to this
+#define STAT_STRIPES 16             // Counter stripes threads spread their updates over
+#define PERCPU_CACHE_BYTES (64 * 1024) // Most a CPU's cache keeps of any one size class
+#define HANDLE_CHUNK_ENTRIES 1024   // Handle table entries allocated from the heap at a time
+#define HANDLE_MAX_CHUNKS 128       // Most chunks a handle table grows to
+#define SEG_RELEASE_MIN (64 * 1024) // Free runs compaction leaves at least this big go back to the OS
+#define SEG_COMPACT_SCAN 4096       // Blocks a compaction step looks at, at most
+
+// Offset of a block from the start of the heap mapping. Free-list links are
+// stored as offsets rather than pointers so the heap works at whatever address
+// each process maps it. 0 is the heap header, so it doubles as "no block".
+typedef size_t heap_off_t;
+
+// Lifetime classes that hinted allocations are routed by
+#define LIFETIME_GENERAL 0          // Unhinted allocations
+#define LIFETIME_LONG 1             // ALLOC_HINT_LONG_LIVED
+#define LIFETIME_REQUEST 2          // ALLOC_HINT_PER_REQUEST and ALLOC_HINT_TRANSIENT
 
 // Block header structure for segregated lists
 typedef struct block {
     size_t size;            // Size of the block (including header)
-    int free;               // 1 if free, 0 if allocated
-    struct block* next;     // Next block in free list
-    struct block* prev;     // Previous block in free list
+    int free;               // 1 if free, 0 if allocated, SEG_CACHED if in a per-CPU cache
+    uint16_t lifetime;      // LIFETIME_* whose lists the block belongs to
+    uint16_t tag;           // Allocation tag (allocated blocks only)
+    heap_off_t next;        // Next block in free list; allocated blocks: handle index + 1 if movable, else 0
+    heap_off_t prev;        // Previous block in free list
 } block_t;
 
 // Buddy system node
 typedef struct buddy_node {
-    int order;                      // Order of the block (2^order bytes)
-    int free;                       // 1 if free, 0 if allocated
-    struct buddy_node* next;        // Next in free list
-    struct buddy_node* prev;        // Previous in free list
+    int16_t order;                  // Order of the block (2^order bytes)
+    uint16_t tag;                   // Allocation tag (allocated blocks only)
+    int free;                       // 1 if free, 0 if allocated, BUDDY_CACHED if held back unmerged
+    heap_off_t next;                // Next in free list
+    heap_off_t prev;                // Previous in free list
 } buddy_node_t;
 
-// Memory allocator structure
+// Freed buddy block kept on its order's cache for reuse instead of being
+// merged (lazy coalescing). Never merged with until flushed.
+#define BUDDY_CACHED 2
+
+// Freed segregated block held in a per-CPU cache. Still allocated as far as
+// the heap is concerned, but a second free of it is caught.
+#define SEG_CACHED 2
+
+#define HEAP_MAGIC 0x48454150u      // "HEAP", marks a formatted heap header
+#define HEAP_VERSION 10             // Bumped whenever the on-heap layout changes
+#define HEAP_HEADER_SIZE 8192       // Space reserved for heap_header_t at the start of the mapping
+
+// Lock word alone on its cache line, so threads taking neighbouring locks
+// don't keep stealing the line from each other
 typedef struct {
-    // Segregated free lists
-    block_t* size_classes[NUM_SIZE_CLASSES];
-    size_t class_sizes[NUM_SIZE_CLASSES];
+    uint32_t word;
+    char pad[CACHE_LINE_SIZE - sizeof(uint32_t)];
+} padded_lock_t;
+
+// Counter updates of the threads that map to one stripe. With fine-grained
+// locking there is no lock to protect common counters, and atomically
+// updating a single set from every thread would serialize them on its cache
+// line. The stripes are deltas, folded into the totals on read.
+typedef struct {
+    size_t allocated;               // Bytes allocated minus bytes freed (wraps when negative)
+    size_t allocation_count;
+    size_t free_count;
+    char pad[CACHE_LINE_SIZE - 3 * sizeof(size_t)];
+} stat_stripe_t;
+
+// Counters of one allocation tag
+typedef struct {
+    size_t live_bytes;
+    size_t peak_bytes;
+    size_t allocation_count;
+    size_t free_count;
+} tag_counters_t;
+
+// Handle table entry of a movable allocation
+typedef struct {
+    heap_off_t off;                 // Block's payload; unused entries: next unused index + 1
+    uint32_t pins;                  // Pin count, or HANDLE_BUSY while claimed
+    uint32_t generation;            // Odd while the handle is live
+} handle_entry_t;
+
+// Fails to compile if tags outgrow the byte the bitmap buddy system keeps them in
+typedef char tag_fits_in_byte[ALLOCATOR_MAX_TAGS <= 256 ? 1 : -1];
+
+// Allocator state kept at the start of the heap mapping itself, so every
+// process that maps a shared heap sees the same free lists and counters.
+typedef struct {
+    uint32_t magic;                 // HEAP_MAGIC once the heap is formatted
+    uint32_t version;               // HEAP_VERSION of the code that formatted it
+    uint32_t lock;                  // Global lock serializing every operation (ALLOCATOR_LOCK_GLOBAL)
+    uint32_t dirty;                 // Set while a persistent heap is open
+    size_t heap_size;               // Size of the whole mapping, header included
+    heap_off_t root;                // User root allocation of a persistent heap
+    
+    // Configuration the heap was created with
+    int engine;                     // allocator_engine_t
+    size_t large_threshold;         // Hybrid heaps: larger requests use the buddy system
+    int lock_mode;                  // allocator_lock_mode_t
+    
+    // Segregated free lists, one set per lifetime class
+    heap_off_t size_classes[NUM_LIFETIMES][NUM_SIZE_CLASSES];
     
     // Buddy system
-    buddy_node_t* buddy_free_lists[MAX_ORDER];
-    void* buddy_heap;
+    heap_off_t buddy_free_lists[MAX_ORDER];
+    heap_off_t buddy_heap;
     size_t buddy_heap_size;
     
+    // Lazy coalescing: freed blocks held back per order, singly linked
+    size_t buddy_cache_limit;       // Blocks kept per order (0 = merge on every free)
+    heap_off_t buddy_cache[MAX_ORDER];
+    size_t buddy_cache_count[MAX_ORDER];
+    
+    // Bitmap buddy system (ALLOCATOR_ENGINE_BITMAP_BUDDY), which uses the
+    // buddy heap. Its bitmaps sit between this header and the buddy heap.
+    size_t bitmap_size;             // Bytes of bitmaps before the buddy heap
+    int bitmap_top_order;           // Highest order with a block inside the heap
+    uint32_t bitmap_nonempty;       // Bit k set while order k has a free block
+    size_t bitmap_count[MAX_ORDER]; // Free blocks per order
+    size_t bitmap_hint[MAX_ORDER];  // Words of each free bitmap below this are all zero
+    heap_off_t bitmap_tag_table;    // Byte per 16 bytes of buddy heap, allocated from it once a block is tagged (0 = none)
+    
+    // Segregated lists heap
+    heap_off_t seg_heap;
+    size_t seg_heap_size;
+    heap_off_t compact_cursor;      // Block the next compaction step starts at (0 = heap start)
+    size_t compact_moved;           // Bytes moved so far in the current compaction pass
+    
+    // Movable allocations: handle table chunks, allocated from the heap
+    heap_off_t handle_chunks[HANDLE_MAX_CHUNKS];
+    size_t handle_chunk_count;
+    size_t handle_free;             // First unused entry, index + 1 (0 = none)
+    size_t handle_count;            // Live handles
+    
     // General heap management
-    void* heap_start;
-    void* heap_end;
     size_t total_allocated;
     size_t total_free;
     
@@ -47,23 +157,151 @@ typedef struct {
     size_t allocation_count;
     size_t free_count;
     size_t fragmentation_count;
-} allocator_t;
+    tag_counters_t tags[ALLOCATOR_MAX_TAGS];    // Per-tag counters (tag 0 unused)
+    
+    // Fine-grained locking (ALLOCATOR_LOCK_FINE). Locks are only ever taken
+    // together by whole-heap operations, in the order: handle table,
+    // segregated classes ascending, then buddy orders ascending.
+    padded_lock_t handle_lock;                  // Handle table chunks and unused entries
+    padded_lock_t seg_locks[NUM_SIZE_CLASSES];  // One per size class, across lifetimes
+    padded_lock_t buddy_locks[MAX_ORDER];       // One per buddy order
+    stat_stripe_t stat_stripes[STAT_STRIPES];   // Counter updates made without a lock
+} heap_header_t;
+
+// Fails to compile if the header outgrows the space reserved for it
+typedef char heap_header_fits[sizeof(heap_header_t) <= HEAP_HEADER_SIZE ? 1 : -1];
+
+// Memory allocator instance: this process's view of one heap
+struct allocator {
+    heap_header_t* hdr;             // Shared state, at the start of the mapping
+    size_t class_sizes[NUM_SIZE_CLASSES];
+    
+    // Local addresses of the mapping
+    void* heap_start;
+    void* heap_end;
+    void* buddy_heap;
+    size_t buddy_heap_size;
+    void* seg_heap;
+    int shared;                     // 1 if the mapping is shared with other processes
+    int persistent;                 // 1 if the mapping is a file that outlives the process
+    int lock_mode;                  // allocator_lock_mode_t, copied from the heap header
+    int latency_critical;           // 1: no syscalls or stdio after creation (private heaps only)
+    int latency_classes;            // Latency-critical: size classes requests are rounded up to, from the smallest
+    size_t buddy_warm[MAX_ORDER];   // Latency-critical: warm buddy (or bitmap buddy) blocks of each order, kept split
+    
+    // Bitmap buddy system: this process's addresses of the per-order bitmaps
+    uint64_t* bitmap_free[MAX_ORDER];   // Bit i set if block i of the order is free
+    uint64_t* bitmap_split[MAX_ORDER];  // Bit i set if block i of the order is split (order > 0)
+    
+    // Guarded sampling: 1 if this instance's allocations are sampled, and
+    // it holds a reference to the pool. Only read on the allocation path; the
+    // countdown to the next sample is kept per thread.
+    int guarded;
+    
+    // Per-CPU caches (private heaps only): this process's mapping of them
+    char* percpu_base;                  // NULL when the caches are off
+    size_t percpu_size;                 // Size of the mapping
+    size_t percpu_stride;               // Bytes from one CPU's caches to the next's
+    uint32_t percpu_cpus;               // CPUs with caches
+    int percpu_classes;                 // Size classes cached, from the smallest
+    size_t percpu_offset[NUM_SIZE_CLASSES];     // Offset of each class's stack in a CPU's caches
+    size_t percpu_capacity[NUM_SIZE_CLASSES];   // Blocks each CPU keeps of each class
+    uint32_t percpu_lock;               // Taken by a thread flushing every CPU's caches
+    size_t percpu_flushed;              // Blocks popped by latency-critical flushes
+};
+
+// Convert between heap offsets and pointers in an instance's mapping
+#define HEAP_PTR(a, off) ((off) ? (void*)((char*)(a)->heap_start + (off)) : NULL)
+#define HEAP_OFF(a, ptr) ((ptr) ? (heap_off_t)((char*)(ptr) - (char*)(a)->heap_start) : 0)
+
+// Sampled guard-page pool. Process-wide, because the fault handler that
+// reports overflows and use-after-frees is process-wide.
+typedef struct {
+    char* start;            // Start of the pool mapping (NULL when disabled)
+    char* end;              // End of the pool mapping
+    size_t page_size;       // Size of each slot and guard page
+    size_t sampled_count;   // Allocations served from the pool so far
+    size_t live_count;      // Sampled allocations not yet freed
+} guarded_pool_t;
 
-// External declaration for the global allocator instance
+// External declaration for the default allocator instance behind my_malloc/my_free
 extern allocator_t g_allocator;
+extern guarded_pool_t g_guarded_pool;
 
 // Function prototypes for internal use (declared in specific .c files, but useful to know they exist)
 // buddy_system.c
-void* buddy_alloc_internal(size_t size);
-void buddy_free_internal(void* ptr);
+void buddy_heap_init(allocator_t* a);
+void* buddy_alloc_internal(allocator_t* a, size_t size, int lifetime);
+void buddy_free_internal(allocator_t* a, void* ptr);
+
+// bitmap_buddy.c
+size_t bitmap_buddy_layout(size_t space);
+void bitmap_buddy_attach(allocator_t* a);
+void bitmap_heap_init(allocator_t* a);
+void* bitmap_alloc_internal(allocator_t* a, size_t size, int lifetime);
+void bitmap_free_internal(allocator_t* a, void* ptr);
+size_t bitmap_usable_size(allocator_t* a, const void* ptr);
+unsigned int bitmap_set_tag(allocator_t* a, void* ptr, unsigned int tag);
+unsigned int bitmap_tag(allocator_t* a, const void* ptr);
+int bitmap_check(allocator_t* a);
 
 // segregated_lists.c
-void* seg_alloc_internal(size_t size);
-void seg_free_internal(void* ptr);
+void seg_heap_init(allocator_t* a);
+int seg_served_classes(const allocator_t* a);
+void* seg_alloc_internal(allocator_t* a, size_t size, int lifetime);
+size_t seg_coalesce(allocator_t* a);
+size_t seg_compact(allocator_t* a, size_t max_bytes, int* done);
+void seg_free_internal(allocator_t* a, void* ptr);
+
+// handles.c
+long handle_reserve(allocator_t* a);
+void handle_unreserve(allocator_t* a, size_t index);
+allocator_handle_t handle_publish(allocator_t* a, size_t index, void* ptr);
+void* handle_claim_for_free(allocator_t* a, allocator_handle_t handle, size_t* index);
+void* handle_pin_internal(allocator_t* a, allocator_handle_t handle);
+void handle_unpin_internal(allocator_t* a, allocator_handle_t handle);
+int handle_claim_block(allocator_t* a, block_t* block);
+void handle_moved(allocator_t* a, block_t* block);
+int handle_check(allocator_t* a);
+
+// percpu_cache.c
+int percpu_cache_init(allocator_t* a, size_t limit);
+void percpu_cache_release(allocator_t* a);
+void* percpu_cache_pop(allocator_t* a, size_t class_idx);
+int percpu_cache_push(allocator_t* a, void* ptr, size_t block_size);
+size_t percpu_cache_drain(allocator_t* a);
+size_t percpu_cached_bytes(const allocator_t* a);
+void percpu_cache_counts(const allocator_t* a, size_t* allocs, size_t* frees);
+
+// allocator.c
+void* heap_alloc(allocator_t* a, size_t size, int lifetime);
+int heap_check(allocator_t* a, int full);
+
+// guarded_pool.c
+int guarded_pool_init(unsigned int sample_rate);
+int guarded_pool_acquire(const allocator_t* a);
+void guarded_pool_release(const allocator_t* a);
+size_t guarded_sample_interval(void);
+void* guarded_alloc_internal(const allocator_t* a, size_t size);
+void guarded_free_internal(void* ptr);
+size_t guarded_usable_size(const void* ptr);
+void guarded_set_tag(void* ptr, unsigned int tag);
+unsigned int guarded_tag(const void* ptr);
 
 // utils.c
+#define HEAP_LOCK_SLEEP  0      // Spins briefly, then sleeps on a futex
+#define HEAP_LOCK_SPIN   1      // Only spins (latency-critical heaps)
+#define HEAP_LOCK_ROBUST 2      // Records its holder, so a dead holder is detected (shared heaps)
+void heap_lock_init(uint32_t* lock, int kind);
+void heap_lock(uint32_t* lock);
+void heap_unlock(uint32_t* lock);
+void heap_count_alloc(allocator_t* a, size_t bytes);
+void heap_count_free(allocator_t* a, size_t bytes);
+void heap_count_tag_alloc(allocator_t* a, unsigned int tag, size_t bytes);
+void heap_count_tag_free(allocator_t* a, unsigned int tag, size_t bytes);
+void heap_read_counters(const allocator_t* a, allocator_stats_t* stats);
 size_t align_size(size_t size);
 int get_order(size_t size);
-size_t get_size_class_index(size_t size);
+size_t get_size_class_index(const allocator_t* a, size_t size);
 
 #endif // ALLOCATOR_H
\ No newline at end of file
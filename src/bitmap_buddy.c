@@ -0,0 +1,447 @@
+#include "allocator.h"
+#include <stdio.h>
+#include <string.h>
+#include <assert.h> // For debugging assertions
+
+// Bitmap buddy system (ALLOCATOR_ENGINE_BITMAP_BUDDY)
+//
+// Blocks carry no header. The state of every block lives in two bitmaps per
+// order, kept between the heap header and the buddy heap:
+//
+//   free  - bit i of order k is set if block i of order k is free
+//   split - bit i of order k is set if block i of order k is split in two
+//
+// Blocks are therefore exactly 2^(order + 4) bytes, and aligned to their size
+// within the (page-aligned) buddy heap: a 4KB request takes a 4KB page-aligned
+// block. On free, a block's order is found by walking down the split bits from
+// the top order. hdr->bitmap_nonempty has bit k set while order k has a free
+// block, so the smallest order able to serve a request is one
+// count-trailing-zeros away, and hdr->bitmap_hint keeps the search within an
+// order from rescanning words known to be empty.
+//
+// Blocks that stick out past the end of the heap count as split, which is
+// what carves a heap that isn't a power of two into aligned blocks.
+//
+// With no header to keep it in, the tag of an allocated block goes in a
+// table of one byte per minimum block. That's twice the size of the bitmaps,
+// so it isn't part of the layout: the first tagged allocation allocates it
+// from the buddy heap, and heaps that never tag a block don't pay for it.
+//
+// Locking (ALLOCATOR_LOCK_FINE) follows buddy_system.c: each order's bitmaps,
+// count and hint are guarded by the order's lock, splitting takes one lock at
+// a time, and merging takes the next order's lock before releasing the
+// current one. The walk down the split bits on free takes no lock: the split
+// bits above an allocated block can't change until it's freed.
+
+#define BITMAP_WORD_BITS 64
+#define BITMAP_HEAP_ALIGN 4096      // The buddy heap after the bitmaps stays page-aligned
+
+// Locks order 'order' when fine-grained locking is on
+static void order_lock(allocator_t* a, int order) {
+    if (a->lock_mode == ALLOCATOR_LOCK_FINE) heap_lock(&a->hdr->buddy_locks[order].word);
+}
+
+static void order_unlock(allocator_t* a, int order) {
+    if (a->lock_mode == ALLOCATOR_LOCK_FINE) heap_unlock(&a->hdr->buddy_locks[order].word);
+}
+
+// Highest order with a block that fits in a heap of 'heap_size' bytes, or -1
+static int top_order(size_t heap_size) {
+    int order = -1;
+    while (order + 1 < MAX_ORDER && (1UL << (order + 1 + 4)) <= heap_size) {
+        order++;
+    }
+    return order;
+}
+
+// Blocks of 'order' that fit in a heap of 'heap_size' bytes, and the words
+// of bitmap they take
+static size_t order_blocks(size_t heap_size, int order) {
+    return heap_size >> (order + 4);
+}
+
+static size_t order_words(size_t heap_size, int order) {
+    return (order_blocks(heap_size, order) + BITMAP_WORD_BITS - 1) / BITMAP_WORD_BITS;
+}
+
+// Bytes of bitmaps for a heap of 'heap_size' bytes. Order 0 blocks are never
+// split, so they have no split bitmap.
+static size_t bitmap_bytes(size_t heap_size) {
+    size_t words = 0;
+    for (int order = 0; order <= top_order(heap_size); order++) {
+        words += order_words(heap_size, order) * (order > 0 ? 2 : 1);
+    }
+    return words * sizeof(uint64_t);
+}
+
+// Bit operations. A bitmap word is only ever changed under its order's lock,
+// so a plain read-modify-write will do; the relaxed atomics only make sure
+// the lock-free walk down the split bits on free reads whole words.
+static int bit_test(const uint64_t* bits, size_t i) {
+    return (__atomic_load_n(&bits[i / BITMAP_WORD_BITS], __ATOMIC_RELAXED) >> (i % BITMAP_WORD_BITS)) & 1;
+}
+
+static void bit_set(uint64_t* bits, size_t i) {
+    uint64_t* word = &bits[i / BITMAP_WORD_BITS];
+    __atomic_store_n(word, *word | (1ULL << (i % BITMAP_WORD_BITS)), __ATOMIC_RELAXED);
+}
+
+static void bit_clear(uint64_t* bits, size_t i) {
+    uint64_t* word = &bits[i / BITMAP_WORD_BITS];
+    __atomic_store_n(word, *word & ~(1ULL << (i % BITMAP_WORD_BITS)), __ATOMIC_RELAXED);
+}
+
+// The nonempty mask is shared by every order, so with fine-grained locking
+// its updates have to be atomic
+static void nonempty_set(allocator_t* a, int order) {
+    if (a->lock_mode == ALLOCATOR_LOCK_FINE) {
+        __atomic_fetch_or(&a->hdr->bitmap_nonempty, 1u << order, __ATOMIC_RELAXED);
+    } else {
+        a->hdr->bitmap_nonempty |= 1u << order;
+    }
+}
+
+static void nonempty_clear(allocator_t* a, int order) {
+    if (a->lock_mode == ALLOCATOR_LOCK_FINE) {
+        __atomic_fetch_and(&a->hdr->bitmap_nonempty, ~(1u << order), __ATOMIC_RELAXED);
+    } else {
+        a->hdr->bitmap_nonempty &= ~(1u << order);
+    }
+}
+
+// Bytes at the start of 'space' to give to the bitmaps, so that the rest of
+// it can be the buddy heap they describe. Sizing the bitmaps for the whole
+// space is slightly more than the smaller heap needs, which keeps this a
+// single step.
+size_t bitmap_buddy_layout(size_t space) {
+    size_t bytes = (bitmap_bytes(space) + BITMAP_HEAP_ALIGN - 1) & ~(size_t)(BITMAP_HEAP_ALIGN - 1);
+    return bytes < space ? bytes : space;
+}
+
+// Points an instance at the bitmaps of its heap. The bitmaps start right
+// after the heap header, free and split bitmaps alternating by order.
+void bitmap_buddy_attach(allocator_t* a) {
+    uint64_t* words = (uint64_t*)((char*)a->heap_start + HEAP_HEADER_SIZE);
+
+    for (int order = 0; order < MAX_ORDER; order++) {
+        a->bitmap_free[order] = NULL;
+        a->bitmap_split[order] = NULL;
+        if (order > a->hdr->bitmap_top_order) continue;
+
+        a->bitmap_free[order] = words;
+        words += order_words(a->buddy_heap_size, order);
+        if (order > 0) {
+            a->bitmap_split[order] = words;
+            words += order_words(a->buddy_heap_size, order);
+        }
+    }
+}
+
+// Marks block 'index' of 'order' free. Caller holds the order's lock.
+static void bitmap_put(allocator_t* a, int order, size_t index) {
+    heap_header_t* hdr = a->hdr;
+    size_t word = index / BITMAP_WORD_BITS;
+
+    bit_set(a->bitmap_free[order], index);
+    if (word < hdr->bitmap_hint[order]) hdr->bitmap_hint[order] = word;
+    if (hdr->bitmap_count[order]++ == 0) {
+        nonempty_set(a, order);
+    }
+}
+
+// Marks free block 'index' of 'order' allocated. Caller holds the order's lock.
+static void bitmap_remove(allocator_t* a, int order, size_t index) {
+    heap_header_t* hdr = a->hdr;
+
+    bit_clear(a->bitmap_free[order], index);
+    if (--hdr->bitmap_count[order] == 0) {
+        nonempty_clear(a, order);
+    }
+}
+
+// Takes the lowest free block of 'order' and returns its index, or -1 if the
+// order has none. Caller holds the order's lock.
+static long bitmap_take(allocator_t* a, int order) {
+    heap_header_t* hdr = a->hdr;
+    uint64_t* bits = a->bitmap_free[order];
+    size_t words = order_words(a->buddy_heap_size, order);
+
+    if (hdr->bitmap_count[order] == 0) return -1;
+
+    for (size_t word = hdr->bitmap_hint[order]; word < words; word++) {
+        if (bits[word]) {
+            size_t index = word * BITMAP_WORD_BITS + (size_t)__builtin_ctzll(bits[word]);
+            hdr->bitmap_hint[order] = word;
+            bitmap_remove(a, order, index);
+            return (long)index;
+        }
+    }
+
+    // Only reachable if the count and the bitmap disagree
+    fprintf(stderr, "Bitmap buddy order %d has no free block despite a count of %zu\n",
+            order, hdr->bitmap_count[order]);
+    assert(0 && "Bitmap buddy free count out of sync");
+    return -1;
+}
+
+// Clears the bitmaps and carves the buddy heap into the largest aligned
+// power-of-2 blocks that fit, marking everything above them split
+void bitmap_heap_init(allocator_t* a) {
+    heap_header_t* hdr = a->hdr;
+    size_t rel = 0;
+
+    hdr->bitmap_top_order = top_order(a->buddy_heap_size);
+    bitmap_buddy_attach(a);
+    memset((char*)a->heap_start + HEAP_HEADER_SIZE, 0, hdr->bitmap_size);
+    for (int order = 0; order < MAX_ORDER; order++) {
+        hdr->bitmap_count[order] = 0;
+        hdr->bitmap_hint[order] = 0;
+    }
+    hdr->bitmap_nonempty = 0;
+    hdr->bitmap_tag_table = 0;
+
+    // Mark the splits on the way down to each free block. Blocks that stick
+    // out past the end of the heap have no bits, they're split implicitly.
+    while (rel + MIN_BLOCK_SIZE <= a->buddy_heap_size) {
+        int order = hdr->bitmap_top_order;
+        size_t block_size = 1UL << (order + 4);
+
+        while (rel % block_size != 0 || rel + block_size > a->buddy_heap_size) {
+            size_t index = rel >> (order + 4);
+            if (index < order_blocks(a->buddy_heap_size, order)) {
+                bit_set(a->bitmap_split[order], index);
+            }
+            order--;
+            block_size >>= 1;
+        }
+
+        bitmap_put(a, order, rel >> (order + 4));
+        rel += block_size;
+    }
+}
+
+// Bitmap buddy allocation (internal). Lifetime hints don't change placement:
+// blocks always come from the lowest free address of their order.
+void* bitmap_alloc_internal(allocator_t* a, size_t size, int lifetime) {
+    heap_header_t* hdr = a->hdr;
+    (void)lifetime;
+
+    // No header, so the block only has to hold the request itself
+    int order = get_order(align_size(size ? size : 1));
+    if (order > hdr->bitmap_top_order || size > (1UL << (order + 4))) {
+        if (a->latency_critical) return NULL; // No stdio
+        fprintf(stderr, "Requested size %zu is too large for bitmap buddy system (max order %d)\n",
+                size, hdr->bitmap_top_order);
+        return NULL;
+    }
+
+    // Lowest nonempty order that can serve the request. Another thread may
+    // empty it between reading the mask and taking the lock; then look again.
+    int current_order;
+    long index;
+    for (;;) {
+        uint32_t candidates = __atomic_load_n(&hdr->bitmap_nonempty, __ATOMIC_RELAXED) >> order << order;
+        if (candidates == 0) {
+            __atomic_fetch_add(&hdr->fragmentation_count, 1, __ATOMIC_RELAXED);
+            return NULL;
+        }
+        current_order = __builtin_ctz(candidates);
+
+        order_lock(a, current_order);
+        index = bitmap_take(a, current_order);
+        if (index >= 0 && current_order > order) {
+            bit_set(a->bitmap_split[current_order], (size_t)index);
+        }
+        order_unlock(a, current_order);
+
+        if (index >= 0) break;
+    }
+
+    // Split down to the requested order, keeping the lower half each time
+    // and freeing the upper one
+    while (current_order > order) {
+        current_order--;
+        index *= 2;
+
+        order_lock(a, current_order);
+        bitmap_put(a, current_order, (size_t)index + 1);
+        if (current_order > order) {
+            bit_set(a->bitmap_split[current_order], (size_t)index);
+        }
+        order_unlock(a, current_order);
+    }
+
+    heap_count_alloc(a, 1UL << (order + 4));
+    return (char*)a->buddy_heap + ((size_t)index << (order + 4));
+}
+
+// Finds the order of the allocated block starting at 'rel' by walking down
+// the split bits. Returns -1 if no block starts there.
+//
+// A block starting at 'rel' can't be of a higher order than the alignment of
+// 'rel' allows, so the walk starts there rather than at the top. That's
+// enough because a block is only ever split while its parent is: the block
+// the walk stops at is real if its parent is split, which the walk has seen
+// unless it stopped right away.
+static int bitmap_find_order(const allocator_t* a, size_t rel) {
+    int top = a->hdr->bitmap_top_order;
+    int start = rel ? __builtin_ctzl(rel) - 4 : top;
+    if (start > top) start = top;
+    if (start < 0) return -1; // Not even aligned to the minimum block size
+
+    int order = start;
+    while (order > 0) {
+        size_t index = rel >> (order + 4);
+        int in_bounds = ((index + 1) << (order + 4)) <= a->buddy_heap_size;
+        if (in_bounds && !bit_test(a->bitmap_split[order], index)) break;
+        order--;
+    }
+
+    if (order == start && order < top) {
+        size_t parent = rel >> (order + 5);
+        if (parent < order_blocks(a->buddy_heap_size, order + 1) &&
+            !bit_test(a->bitmap_split[order + 1], parent)) {
+            return -1; // Inside a larger block
+        }
+    }
+    return order;
+}
+
+// Bitmap buddy deallocation (internal)
+void bitmap_free_internal(allocator_t* a, void* ptr) {
+    if (!ptr) return;
+
+    size_t rel = (size_t)((char*)ptr - (char*)a->buddy_heap);
+    int order = bitmap_find_order(a, rel);
+
+    if (order < 0) {
+        fprintf(stderr, "Invalid free of %p: not the start of a bitmap buddy block\n", ptr);
+        assert(0 && "Invalid free of bitmap buddy block");
+        return;
+    }
+
+    size_t index = rel >> (order + 4);
+    if (bit_test(a->bitmap_free[order], index)) {
+        fprintf(stderr, "Double free detected or freeing an already free bitmap buddy block: %p\n", ptr);
+        assert(0 && "Double free or freeing already free bitmap buddy block");
+        return;
+    }
+
+    heap_count_free(a, 1UL << (order + 4));
+
+    // Merge with free buddies as far as possible. The block itself isn't
+    // marked free until it's final, and the current order's lock is held
+    // until the next one is taken (see the locking notes at the top). A
+    // latency-critical heap keeps as many free blocks of each order as it
+    // has warm blocks of it, even if their buddies are free too.
+    order_lock(a, order);
+    while (order < a->hdr->bitmap_top_order) {
+        size_t buddy = index ^ 1;
+
+        // The buddy may not exist if the heap isn't a power of 2
+        if (((buddy + 1) << (order + 4)) > a->buddy_heap_size ||
+            !bit_test(a->bitmap_free[order], buddy) ||
+            a->hdr->bitmap_count[order] < a->buddy_warm[order]) {
+            break;
+        }
+        bitmap_remove(a, order, buddy);
+
+        order_lock(a, order + 1);
+        order_unlock(a, order);
+        order++;
+        index >>= 1;
+        bit_clear(a->bitmap_split[order], index);
+    }
+    bitmap_put(a, order, index);
+    order_unlock(a, order);
+}
+
+// Usable size of an allocated block, which is all of it
+size_t bitmap_usable_size(allocator_t* a, const void* ptr) {
+    int order = bitmap_find_order(a, (size_t)((const char*)ptr - (const char*)a->buddy_heap));
+    return order < 0 ? 0 : 1UL << (order + 4);
+}
+
+// The tag table, or NULL if no block has been tagged yet
+static uint8_t* bitmap_tag_table(const allocator_t* a) {
+    return (uint8_t*)HEAP_PTR(a, __atomic_load_n(&a->hdr->bitmap_tag_table, __ATOMIC_ACQUIRE));
+}
+
+// Allocates the tag table, an ordinary block as far as the rest of the heap
+// is concerned. With fine-grained locking two threads may race to do it;
+// the loser frees its copy. Returns NULL if the heap has no room for it.
+static uint8_t* bitmap_tag_table_create(allocator_t* a) {
+    size_t bytes = order_blocks(a->buddy_heap_size, 0);
+    uint8_t* table = (uint8_t*)bitmap_alloc_internal(a, bytes, LIFETIME_GENERAL);
+    if (!table) return NULL;
+    memset(table, 0, bytes);
+
+    heap_off_t existing = 0;
+    if (!__atomic_compare_exchange_n(&a->hdr->bitmap_tag_table, &existing, HEAP_OFF(a, table), 0,
+                                     __ATOMIC_RELEASE, __ATOMIC_ACQUIRE)) {
+        bitmap_free_internal(a, table);
+        return (uint8_t*)HEAP_PTR(a, existing);
+    }
+    return table;
+}
+
+// Stores the tag of the allocated block at 'ptr' and returns it. Blocks
+// can't be tagged if the tag table doesn't fit in the heap; they're left
+// untagged and 0 is returned.
+unsigned int bitmap_set_tag(allocator_t* a, void* ptr, unsigned int tag) {
+    uint8_t* table = bitmap_tag_table(a);
+    if (!table) {
+        if (!tag) return 0; // Nothing tagged yet, so nothing to overwrite
+        table = bitmap_tag_table_create(a);
+        if (!table) return 0;
+    }
+    table[(size_t)((char*)ptr - (char*)a->buddy_heap) / MIN_BLOCK_SIZE] = (uint8_t)tag;
+    return tag;
+}
+
+unsigned int bitmap_tag(allocator_t* a, const void* ptr) {
+    uint8_t* table = bitmap_tag_table(a);
+    return table ? table[(size_t)((const char*)ptr - (const char*)a->buddy_heap) / MIN_BLOCK_SIZE] : 0;
+}
+
+// Counts inconsistencies in the bitmaps: counts and the nonempty mask must
+// match the free bits, no word below a hint may have free bits, and a free
+// block can be neither split itself nor half of a free parent.
+int bitmap_check(allocator_t* a) {
+    heap_header_t* hdr = a->hdr;
+    int problems = 0;
+
+    if (hdr->bitmap_size != bitmap_buddy_layout(hdr->buddy_heap_size + hdr->bitmap_size) ||
+        hdr->bitmap_top_order != top_order(a->buddy_heap_size)) {
+        return 1; // Bitmaps don't belong to this heap
+    }
+
+    for (int order = 0; order <= hdr->bitmap_top_order; order++) {
+        const uint64_t* bits = a->bitmap_free[order];
+        size_t words = order_words(a->buddy_heap_size, order);
+        size_t blocks = order_blocks(a->buddy_heap_size, order);
+        size_t count = 0;
+
+        for (size_t word = 0; word < words; word++) {
+            if (bits[word] && word < hdr->bitmap_hint[order]) problems++;
+            count += (size_t)__builtin_popcountll(bits[word]);
+        }
+        if (count != hdr->bitmap_count[order] ||
+            !!(hdr->bitmap_nonempty & (1u << order)) != (count > 0)) {
+            problems++;
+        }
+
+        for (size_t index = 0; index < blocks; index++) {
+            if (!bit_test(bits, index)) continue;
+            if (order > 0 && bit_test(a->bitmap_split[order], index)) problems++;
+            if (order < hdr->bitmap_top_order && (index >> 1) < order_blocks(a->buddy_heap_size, order + 1) &&
+                bit_test(a->bitmap_free[order + 1], index >> 1)) {
+                problems++;
+            }
+        }
+        if (blocks % BITMAP_WORD_BITS && (bits[words - 1] >> (blocks % BITMAP_WORD_BITS))) {
+            problems++; // Free bits past the last block
+        }
+    }
+    return problems;
+}
@@ -7,137 +7,425 @@ extern int get_order(size_t size);
 extern size_t align_size(size_t size); // Although buddy system works with powers of 2,
                                         // internal alignment might still be relevant for headers.
 
+// Locking (ALLOCATOR_LOCK_FINE)
+//
+// Every order's free list has its own lock. A block header reading free with
+// order k is always on list k, and only becomes or stops being so under lock
+// k; blocks being split or merged are marked allocated while they're off the
+// lists, so no other thread can merge with them.
+//
+// Splitting takes one lock at a time. Merging holds the lock of the order
+// it's at and takes the next order's lock before releasing it, so a merged
+// block never drops out of sight of an allocation scanning up the orders.
+// Since locks are only ever nested in ascending order, this can't deadlock.
+
+static void order_lock(allocator_t* a, int order) {
+    if (a->lock_mode == ALLOCATOR_LOCK_FINE) heap_lock(&a->hdr->buddy_locks[order].word);
+}
+
+static void order_unlock(allocator_t* a, int order) {
+    if (a->lock_mode == ALLOCATOR_LOCK_FINE) heap_unlock(&a->hdr->buddy_locks[order].word);
+}
+
+// Marks a block free and pushes it onto the head of the free list for its
+// order. Caller holds the order's lock.
+static void buddy_list_push(allocator_t* a, buddy_node_t* block) {
+    heap_header_t* hdr = a->hdr;
+    heap_off_t head = hdr->buddy_free_lists[block->order];
+
+    block->next = head;
+    block->prev = 0;
+    if (head) {
+        ((buddy_node_t*)HEAP_PTR(a, head))->prev = HEAP_OFF(a, block);
+    }
+    hdr->buddy_free_lists[block->order] = HEAP_OFF(a, block);
+
+    // Publish the free state last, so a thread checking whether it can merge
+    // with this block never sees it free with a stale order
+    __atomic_store_n(&block->free, 1, __ATOMIC_RELEASE);
+}
+
+// Unlinks a free block from the free list for its order and marks it
+// allocated. Caller holds the order's lock.
+static void buddy_list_remove(allocator_t* a, buddy_node_t* block) {
+    heap_header_t* hdr = a->hdr;
+
+    if (block->prev) {
+        ((buddy_node_t*)HEAP_PTR(a, block->prev))->next = block->next;
+    } else {
+        hdr->buddy_free_lists[block->order] = block->next;
+    }
+    if (block->next) {
+        ((buddy_node_t*)HEAP_PTR(a, block->next))->prev = block->prev;
+    }
+    block->free = 0;
+}
+
+// Takes a free block of order 'order' up to 'max_order' off the free lists
+// and returns its order through 'found_order'. Lists are locked one at a time,
+// and lists that look empty aren't locked at all. Long-lived allocations
+// take the highest block on the list (see buddy_alloc_internal).
+static buddy_node_t* buddy_take(allocator_t* a, int order, int max_order, int take_high, int* found_order) {
+    heap_header_t* hdr = a->hdr;
+
+    for (int current_order = order; current_order <= max_order; current_order++) {
+        if (__atomic_load_n(&hdr->buddy_free_lists[current_order], __ATOMIC_RELAXED) == 0) {
+            continue;
+        }
+
+        order_lock(a, current_order);
+        buddy_node_t* block = (buddy_node_t*)HEAP_PTR(a, hdr->buddy_free_lists[current_order]);
+        if (block && take_high) {
+            for (buddy_node_t* candidate = block; candidate;
+                 candidate = (buddy_node_t*)HEAP_PTR(a, candidate->next)) {
+                if (candidate > block) block = candidate;
+            }
+        }
+        if (block) {
+            buddy_list_remove(a, block);
+        }
+        order_unlock(a, current_order);
+
+        if (block) {
+            *found_order = current_order;
+            return block;
+        }
+    }
+    return NULL;
+}
+
+// Lazy coalescing
+//
+// Merging a freed block all the way up and splitting it all the way down
+// again on the next allocation of the same size is most of the cost of an
+// alloc/free loop. With a cache limit set, freed blocks are instead kept on a
+// per-order cache, marked BUDDY_CACHED so nothing merges with them, and
+// handed straight back out by allocations of their order. Frees beyond the
+// limit merge as usual. Caches are guarded by the lock of their order.
+//
+// Cached blocks shouldn't leave the heap more fragmented than eager
+// coalescing would, so wherever eager coalescing would have merged one and
+// used a different block, the cache gives way: a block freed next to its
+// cached buddy merges with it, a cached block is merged rather than reused
+// when its buddy is free and another free block of its order exists, and
+// every cache is flushed before an allocation splits a larger block. What
+// is left is the alloc/free loop the cache is for, where eager coalescing
+// merges a block only to split the same block again.
+
+// Blocks of 'order' the cache may hold. Besides the configured limit, no
+// order may hold back more than 1/64 of the buddy heap: held-back blocks
+// keep their buddies from merging, so larger caches fragment the heap. One
+// block is always allowed, so large orders of small heaps are cached too. A
+// latency-critical heap always has room for its warm blocks of the order.
+static size_t buddy_cache_capacity(const allocator_t* a, int order) {
+    size_t limit = a->hdr->buddy_cache_limit;
+    size_t by_size = a->buddy_heap_size >> (order + 4 + 6);
+    if (by_size == 0) by_size = 1;
+    size_t capacity = limit < by_size ? limit : by_size;
+    return capacity > a->buddy_warm[order] ? capacity : a->buddy_warm[order];
+}
+
+// Puts a freed block on its order's cache. Returns 0 if the cache is full.
+static int buddy_cache_put(allocator_t* a, buddy_node_t* block) {
+    heap_header_t* hdr = a->hdr;
+    int order = block->order;
+    size_t capacity = buddy_cache_capacity(a, order);
+    int cached = 0;
+
+    if (capacity == 0) return 0;
+
+    order_lock(a, order);
+    if (hdr->buddy_cache_count[order] < capacity) {
+        block->next = hdr->buddy_cache[order];
+        block->free = BUDDY_CACHED;
+        hdr->buddy_cache[order] = HEAP_OFF(a, block);
+        hdr->buddy_cache_count[order]++;
+        cached = 1;
+    }
+    order_unlock(a, order);
+    return cached;
+}
+
+static void buddy_coalesce_block(allocator_t* a, buddy_node_t* block);
+
+// A block's buddy, or NULL if it has none (top order, or past the end of a
+// buddy heap that isn't a power of 2)
+static buddy_node_t* buddy_of(const allocator_t* a, const buddy_node_t* block) {
+    size_t block_size = 1UL << (block->order + 4);
+    size_t buddy_rel = (size_t)((const char*)block - (const char*)a->buddy_heap) ^ block_size;
+    if (block->order >= MAX_ORDER - 1 || buddy_rel + block_size > a->buddy_heap_size) return NULL;
+    return (buddy_node_t*)((char*)a->buddy_heap + buddy_rel);
+}
+
+// Takes the cached buddy of a block being freed out of its cache and lists
+// it as free, so the two merge as eager coalescing would have merged them.
+// Returns 0 if the buddy isn't cached.
+static int buddy_uncache(allocator_t* a, const buddy_node_t* block) {
+    heap_header_t* hdr = a->hdr;
+    int order = block->order;
+    buddy_node_t* buddy = buddy_of(a, block);
+    if (!buddy || __atomic_load_n(&buddy->free, __ATOMIC_RELAXED) != BUDDY_CACHED ||
+        buddy->order != order) {
+        return 0;
+    }
+
+    int found = 0;
+    order_lock(a, order);
+    for (heap_off_t* link = &hdr->buddy_cache[order]; *link;
+         link = &((buddy_node_t*)HEAP_PTR(a, *link))->next) {
+        if (*link == HEAP_OFF(a, buddy)) {
+            *link = buddy->next;
+            hdr->buddy_cache_count[order]--;
+            buddy_list_push(a, buddy);
+            found = 1;
+            break;
+        }
+    }
+    order_unlock(a, order);
+    return found;
+}
+
+// Whether eager coalescing would not have handed out this cached block: its
+// buddy is free, so the two would have merged, and another free block of
+// the order would have been used instead
+static int buddy_cache_stale(const allocator_t* a, const buddy_node_t* block) {
+    const buddy_node_t* buddy = buddy_of(a, block);
+    if (!buddy || __atomic_load_n(&buddy->free, __ATOMIC_ACQUIRE) != 1 || buddy->order != block->order) {
+        return 0;
+    }
+
+    heap_off_t head = __atomic_load_n(&a->hdr->buddy_free_lists[block->order], __ATOMIC_RELAXED);
+    return head && (head != HEAP_OFF(a, buddy) || ((const buddy_node_t*)HEAP_PTR(a, head))->next);
+}
+
+// Takes a block of exactly 'order' from its cache, or returns NULL. Stale
+// blocks are merged instead. Latency-critical heaps hand out their warm
+// blocks regardless.
+static buddy_node_t* buddy_cache_get(allocator_t* a, int order) {
+    heap_header_t* hdr = a->hdr;
+
+    for (;;) {
+        if (__atomic_load_n(&hdr->buddy_cache_count[order], __ATOMIC_RELAXED) == 0) return NULL;
+
+        buddy_node_t* block = NULL;
+        order_lock(a, order);
+        if (hdr->buddy_cache[order]) {
+            block = (buddy_node_t*)HEAP_PTR(a, hdr->buddy_cache[order]);
+            hdr->buddy_cache[order] = block->next;
+            hdr->buddy_cache_count[order]--;
+            block->free = 0;
+        }
+        order_unlock(a, order);
+
+        if (!block || a->latency_critical || !buddy_cache_stale(a, block)) return block;
+        buddy_coalesce_block(a, block);
+    }
+}
+
+// Carves the buddy heap into the largest aligned power-of-2 blocks that fit
+// and puts them on the free lists
+void buddy_heap_init(allocator_t* a) {
+    size_t rel = 0;
+
+    while (rel + MIN_BLOCK_SIZE <= a->buddy_heap_size) {
+        int order = MAX_ORDER - 1;
+        size_t block_size = 1UL << (order + 4);
+
+        // Blocks must stay aligned to their size within the buddy heap, or
+        // the XOR trick in buddy_free_internal would find the wrong buddy
+        while (rel % block_size != 0 || rel + block_size > a->buddy_heap_size) {
+            order--;
+            block_size >>= 1;
+        }
+
+        buddy_node_t* block = (buddy_node_t*)((char*)a->buddy_heap + rel);
+        block->order = order;
+        buddy_list_push(a, block);
+        rel += block_size;
+    }
+}
+
+// Merges a block that has just become free with its free buddies as far as
+// possible and puts the result on the free list for its final order
+static void buddy_coalesce_block(allocator_t* a, buddy_node_t* block) {
+    size_t block_size = 1UL << (block->order + 4);
+
+    // The block stays marked allocated until it's pushed onto a free list,
+    // and the current order's lock is held until the next one is taken (see
+    // the locking notes at the top).
+    order_lock(a, block->order);
+    while (block->order < MAX_ORDER - 1) {
+        // Calculate buddy position relative to the start of the buddy heap
+        size_t block_rel = (size_t)((char*)block - (char*)a->buddy_heap);
+
+        // The buddy's position is found by XORing the block's position with its block size.
+        // This works because buddies are always aligned to their block size within the
+        // buddy heap (the heap itself is only page-aligned, so absolute addresses won't do).
+        size_t buddy_rel = block_rel ^ block_size;
+
+        // Check if buddy is within heap bounds (the buddy heap need not be a power of 2)
+        if (buddy_rel + block_size > a->buddy_heap_size) {
+            break; // Buddy is out of bounds, cannot merge
+        }
+
+        buddy_node_t* buddy = (buddy_node_t*)((char*)a->buddy_heap + buddy_rel);
+
+        // Check if buddy is free and of the same order. Pairs with the
+        // release in buddy_list_push, so 'order' is never stale.
+        if (__atomic_load_n(&buddy->free, __ATOMIC_ACQUIRE) != 1 || buddy->order != block->order) {
+            break; // Cannot merge
+        }
+
+        // Merge condition met: remove buddy from its free list
+        buddy_list_remove(a, buddy);
+
+        // Update the block pointer to the lower address of the merged pair
+        if (buddy_rel < block_rel) {
+            block = buddy;
+        }
+
+        order_lock(a, block->order + 1);
+        order_unlock(a, block->order);
+        block->order++; // Increment order of the merged block
+        block_size <<= 1; // Double the block size for the new order
+    }
+
+    // Add merged block to its new, potentially higher, order free list
+    buddy_list_push(a, block);
+    order_unlock(a, block->order);
+}
+
+// Coalesces every cached block. Returns the number of blocks flushed.
+static size_t buddy_cache_flush(allocator_t* a) {
+    heap_header_t* hdr = a->hdr;
+    size_t flushed = 0;
+
+    for (int order = 0; order < MAX_ORDER; order++) {
+        if (__atomic_load_n(&hdr->buddy_cache_count[order], __ATOMIC_RELAXED) == 0) continue;
+
+        // Detach the whole cache; its blocks stay BUDDY_CACHED until merged
+        order_lock(a, order);
+        heap_off_t off = hdr->buddy_cache[order];
+        hdr->buddy_cache[order] = 0;
+        hdr->buddy_cache_count[order] = 0;
+        order_unlock(a, order);
+
+        while (off) {
+            buddy_node_t* block = (buddy_node_t*)HEAP_PTR(a, off);
+            off = block->next;
+            block->free = 0;
+            buddy_coalesce_block(a, block);
+            flushed++;
+        }
+    }
+    return flushed;
+}
+
 // Buddy system allocation (internal)
-void* buddy_alloc_internal(size_t size) {
+void* buddy_alloc_internal(allocator_t* a, size_t size, int lifetime) {
+    heap_header_t* hdr = a->hdr;
+
     // Calculate the required order, including space for the buddy_node_t header.
     // The actual allocated block size will be 2^(order + 4) (since MIN_BLOCK_SIZE is 16 = 2^4)
     size_t required_block_size_with_header = align_size(size + sizeof(buddy_node_t));
     int order = get_order(required_block_size_with_header);
-    
+
     if (order >= MAX_ORDER) {
+        if (a->latency_critical) return NULL; // No stdio
         fprintf(stderr, "Requested size %zu is too large for buddy system (max order %d)\n", size, MAX_ORDER -1);
         return NULL;
     }
-    
-    // Find a free block of appropriate order
+
+    // Find a free block of appropriate order and remove it from its free list.
+    // Long-lived allocations take the highest block on the list and keep the
+    // upper half of every split, so they collect at the top of the heap and
+    // don't pin the blocks that short-lived allocations split and merge at
+    // the bottom.
+    int take_high = lifetime == LIFETIME_LONG;
     int current_order = order;
-    while (current_order < MAX_ORDER && 
-           g_allocator.buddy_free_lists[current_order] == NULL) {
-        current_order++;
+    buddy_node_t* block = NULL;
+
+    // A cached block of the right order is used first, then a free one.
+    // Long-lived allocations skip the cache, which doesn't know where its
+    // blocks are.
+    if (!take_high) {
+        block = buddy_cache_get(a, order);
     }
-    
-    if (current_order >= MAX_ORDER) {
-        // No suitable block found, potentially out of memory or highly fragmented
-        g_allocator.fragmentation_count++;
-        return NULL; 
+    if (!block) {
+        block = buddy_take(a, order, order, take_high, &current_order);
     }
-    
-    // Remove block from free list
-    buddy_node_t* block = g_allocator.buddy_free_lists[current_order];
-    g_allocator.buddy_free_lists[current_order] = block->next;
-    if (block->next) {
-        block->next->prev = NULL;
+    if (!block && hdr->buddy_cache_limit && !a->latency_critical && buddy_cache_flush(a)) {
+        // Merge the cached blocks before splitting one (see the notes on lazy
+        // coalescing). Latency-critical heaps keep their warm blocks split.
+        block = buddy_take(a, order, order, take_high, &current_order);
+    }
+    if (!block) {
+        block = buddy_take(a, order + 1, MAX_ORDER - 1, take_high, &current_order);
+    }
+
+    if (!block) {
+        // No suitable block found, potentially out of memory or highly fragmented
+        __atomic_fetch_add(&hdr->fragmentation_count, 1, __ATOMIC_RELAXED);
+        return NULL;
     }
-    
+
     // Split block if necessary until it reaches the requested order
     while (current_order > order) {
         current_order--;
-        
+
         // Calculate buddy address
         // The block size for the current order is 2^(current_order + 4)
-        size_t block_size_at_current_order = 1UL << (current_order + 4); 
+        size_t block_size_at_current_order = 1UL << (current_order + 4);
         buddy_node_t* buddy = (buddy_node_t*)((char*)block + block_size_at_current_order);
-        
+        if (take_high) {
+            buddy = block;
+            block = (buddy_node_t*)((char*)block + block_size_at_current_order);
+        }
+
+        // The kept half needs its header before its buddy is listed: with
+        // fine-grained locking another thread may take the buddy, free it
+        // and look at the kept half to see whether they can merge
+        block->free = 0;
+        block->order = current_order;
+
         // Initialize buddy
         buddy->order = current_order;
-        buddy->free = 1;
-        buddy->next = g_allocator.buddy_free_lists[current_order];
-        buddy->prev = NULL;
-        
-        if (g_allocator.buddy_free_lists[current_order]) {
-            g_allocator.buddy_free_lists[current_order]->prev = buddy;
-        }
-        g_allocator.buddy_free_lists[current_order] = buddy;
+        order_lock(a, current_order);
+        buddy_list_push(a, buddy);
+        order_unlock(a, current_order);
     }
-    
+
     block->free = 0;
     block->order = order; // Assign the correct order to the allocated block
-    
+
     size_t allocated_size_with_header = (1UL << (order + 4));
-    g_allocator.allocation_count++;
-    g_allocator.total_allocated += allocated_size_with_header;
-    g_allocator.total_free -= allocated_size_with_header;
-    
+    heap_count_alloc(a, allocated_size_with_header);
+
     return (char*)block + sizeof(buddy_node_t); // Return pointer to user data
 }
 
 // Buddy system deallocation (internal)
-void buddy_free_internal(void* ptr) {
+void buddy_free_internal(allocator_t* a, void* ptr) {
     if (!ptr) return;
-    
+
     // Get the block header from the user pointer
     buddy_node_t* block = (buddy_node_t*)((char*)ptr - sizeof(buddy_node_t));
-    
+
     // Basic validation
     if (block->free) {
         fprintf(stderr, "Double free detected or freeing an already free buddy block: %p\n", ptr);
         assert(0 && "Double free or freeing already free buddy block");
         return;
     }
-    
-    block->free = 1;
-    
+
     size_t block_size = 1UL << (block->order + 4); // Actual size of this block
-    g_allocator.free_count++;
-    g_allocator.total_allocated -= block_size;
-    g_allocator.total_free += block_size;
-    
-    // Try to merge with buddy
-    while (block->order < MAX_ORDER - 1) {
-        // Calculate buddy address
-        uintptr_t block_addr = (uintptr_t)block;
-        
-        // The buddy's address is found by XORing the block's address with its block size.
-        // This works because buddies are always aligned to their block size.
-        uintptr_t buddy_addr = block_addr ^ block_size;
-        
-        // Check if buddy is within heap bounds
-        if (buddy_addr < (uintptr_t)g_allocator.buddy_heap ||
-            buddy_addr >= (uintptr_t)g_allocator.buddy_heap + g_allocator.buddy_heap_size) {
-            break; // Buddy is out of bounds, cannot merge
-        }
-        
-        buddy_node_t* buddy = (buddy_node_t*)buddy_addr;
-        
-        // Check if buddy is free and of the same order
-        if (!buddy->free || buddy->order != block->order) {
-            break; // Cannot merge
-        }
-        
-        // Merge condition met: remove buddy from its free list
-        if (buddy->prev) {
-            buddy->prev->next = buddy->next;
-        } else {
-            g_allocator.buddy_free_lists[buddy->order] = buddy->next;
-        }
-        if (buddy->next) {
-            buddy->next->prev = buddy->prev;
-        }
-        
-        // Update the block pointer to the lower address of the merged pair
-        if (buddy_addr < block_addr) {
-            block = buddy;
-        }
-        
-        block->order++; // Increment order of the merged block
-        block_size <<= 1; // Double the block size for the new order
-    }
-    
-    // Add merged block to its new, potentially higher, order free list
-    block->next = g_allocator.buddy_free_lists[block->order];
-    block->prev = NULL;
-    if (g_allocator.buddy_free_lists[block->order]) {
-        g_allocator.buddy_free_lists[block->order]->prev = block;
+    heap_count_free(a, block_size);
+
+    // Keep the block for reuse if lazy coalescing is on and its cache has
+    // room, unless its buddy is cached too (see the notes on lazy coalescing)
+    if ((a->latency_critical || !buddy_uncache(a, block)) && buddy_cache_put(a, block)) {
+        return;
     }
-    g_allocator.buddy_free_lists[block->order] = block;
-}
\ No newline at end of file
+
+    buddy_coalesce_block(a, block);
+}
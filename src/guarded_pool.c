@@ -0,0 +1,390 @@
+#define _GNU_SOURCE // For MAP_ANONYMOUS, sigaction and backtrace
+#include "allocator.h" // Includes guarded_pool_t definition
+#include <stdio.h>
+#include <string.h>
+#include <signal.h>
+#include <execinfo.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#include <assert.h> // For debugging assertions
+
+// Sampled guard-page pool.
+//
+// A small fraction of allocations is served from a dedicated mapping laid out as
+//
+//   [guard][slot 0][guard][slot 1][guard] ... [slot N-1][guard]
+//
+// where every slot and every guard is one page. Guard pages are always PROT_NONE,
+// so running off either end of a sampled allocation faults immediately. When a
+// sampled allocation is freed its slot is made PROT_NONE as well, so any later
+// use-after-free faults too. Slots are recycled oldest-first to keep freed slots
+// poisoned for as long as possible.
+//
+// The cost on the normal allocation path is one decrement of a countdown in
+// my_malloc; everything else only runs for the sampled allocations, under a
+// lock of the pool's own so thread-safe instances can share it.
+//
+// The pool is shared by every sampled instance. Turning sampling on takes a
+// reference to it, and so does each instance taking part; the pool is only
+// unmapped once sampling is off and the last of those instances is gone.
+// Destroying an instance frees the slots still live from it.
+
+#define SLOT_EMPTY 0 // Never used
+#define SLOT_LIVE  1 // Holds a live allocation
+#define SLOT_FREED 2 // Freed and poisoned, kept around for use-after-free reports
+
+typedef struct {
+    int state;
+    const allocator_t* owner;                // Instance the allocation was made from
+    char* addr;                              // User pointer handed out
+    size_t size;                             // Requested size
+    unsigned int tag;                        // Allocation tag
+    void* alloc_stack[GUARDED_STACK_DEPTH];  // Where the allocation was made
+    int alloc_depth;
+    void* free_stack[GUARDED_STACK_DEPTH];   // Where it was freed (SLOT_FREED only)
+    int free_depth;
+} guarded_slot_t;
+
+guarded_pool_t g_guarded_pool = {0};
+
+static guarded_slot_t g_slots[GUARDED_POOL_SLOTS];
+static size_t g_next_slot;              // Round-robin cursor for slot reuse
+static unsigned int g_sample_rate;      // Average number of allocations per sample
+static unsigned int g_rng_state;        // xorshift state for sample intervals
+static struct sigaction g_prev_segv;    // Handler we replaced, restored on fault/cleanup
+static uint32_t g_lock;                 // Serializes slot and sampling state between threads
+static size_t g_refs;                   // Instances taking part, plus one while sampling is on
+static int g_enabled;                   // 1 while sampling is on (holds a reference)
+
+// Address of the first byte of slot 'i'.
+static char* slot_page(size_t i) {
+    return g_guarded_pool.start + (2 * i + 1) * g_guarded_pool.page_size;
+}
+
+// Writes a message to stderr without going through stdio (safe from the fault handler).
+static void report(const char* msg) {
+    ssize_t ignored = write(STDERR_FILENO, msg, strlen(msg));
+    (void)ignored;
+}
+
+// Writes a number to stderr in 'base' (10 or 16, the latter with 0x), the
+// fault handler's replacement for printf
+static void report_number(uintptr_t value, unsigned int base) {
+    char buf[2 + 2 * sizeof(uintptr_t) * 2 + 1];
+    char* pos = buf + sizeof(buf) - 1;
+
+    *pos = '\0';
+    do {
+        *--pos = "0123456789abcdef"[value % base];
+        value /= base;
+    } while (value);
+    if (base == 16) {
+        *--pos = 'x';
+        *--pos = '0';
+    }
+    report(pos);
+}
+
+static void report_slot(const guarded_slot_t* slot) {
+    report("  ");
+    report_number(slot->size, 10);
+    report("-byte allocation at ");
+    report_number((uintptr_t)slot->addr, 16);
+    report(" was allocated at:\n");
+    backtrace_symbols_fd(slot->alloc_stack, slot->alloc_depth, STDERR_FILENO);
+    if (slot->state == SLOT_FREED) {
+        report("  and freed at:\n");
+        backtrace_symbols_fd(slot->free_stack, slot->free_depth, STDERR_FILENO);
+    }
+}
+
+// Finds the slot responsible for a faulting address inside the pool and
+// describes the error. Returns NULL if no slot can be blamed.
+static const guarded_slot_t* diagnose(char* fault, const char** kind) {
+    size_t page = (size_t)(fault - g_guarded_pool.start) / g_guarded_pool.page_size;
+
+    if (page % 2 == 1) {
+        // Fault inside a slot: it is poisoned, so the allocation has been freed
+        const guarded_slot_t* slot = &g_slots[page / 2];
+        *kind = "use-after-free";
+        return slot->state == SLOT_EMPTY ? NULL : slot;
+    }
+
+    // Fault on a guard page: blame the nearest allocation on either side
+    const guarded_slot_t* left = page > 0 ? &g_slots[page / 2 - 1] : NULL;
+    const guarded_slot_t* right = page / 2 < GUARDED_POOL_SLOTS ? &g_slots[page / 2] : NULL;
+    if (left && left->state == SLOT_EMPTY) left = NULL;
+    if (right && right->state == SLOT_EMPTY) right = NULL;
+
+    if (left && right) {
+        size_t left_dist = (size_t)(fault - (left->addr + left->size));
+        size_t right_dist = (size_t)(right->addr - fault);
+        if (right_dist < left_dist) left = NULL;
+        else right = NULL;
+    }
+    if (left) {
+        *kind = left->state == SLOT_FREED ? "use-after-free (overflow)" : "heap-buffer-overflow";
+        return left;
+    }
+    if (right) {
+        *kind = right->state == SLOT_FREED ? "use-after-free (underflow)" : "heap-buffer-underflow";
+        return right;
+    }
+    return NULL;
+}
+
+static void guarded_fault_handler(int sig, siginfo_t* info, void* context) {
+    char* fault = (char*)info->si_addr;
+
+    if (fault >= g_guarded_pool.start && fault < g_guarded_pool.end) {
+        const char* kind = "invalid access";
+        const guarded_slot_t* slot = diagnose(fault, &kind);
+
+        // Only async-signal-safe calls from here on: no stdio
+        report("\n=== Guarded pool: ");
+        report(kind);
+        report(" at address ");
+        report_number((uintptr_t)fault, 16);
+        report(" ===\n");
+        if (slot) {
+            report_slot(slot);
+        }
+
+        // Restore the previous handler and return: the faulting instruction
+        // re-executes and the process dies the way it would have without us.
+        sigaction(SIGSEGV, &g_prev_segv, NULL);
+        return;
+    }
+
+    // Not ours: hand the fault to whoever was installed before us
+    if (g_prev_segv.sa_flags & SA_SIGINFO) {
+        g_prev_segv.sa_sigaction(sig, info, context);
+    } else if (g_prev_segv.sa_handler != SIG_DFL && g_prev_segv.sa_handler != SIG_IGN) {
+        g_prev_segv.sa_handler(sig);
+    } else {
+        sigaction(SIGSEGV, &g_prev_segv, NULL);
+    }
+}
+
+// Returns the number of allocations until the next sample, uniformly
+// distributed in [1, 2 * sample_rate] so sampling can't lock onto a pattern.
+size_t guarded_sample_interval(void) {
+    if (!g_sample_rate) return 0;
+
+    heap_lock(&g_lock);
+    g_rng_state ^= g_rng_state << 13;
+    g_rng_state ^= g_rng_state >> 17;
+    g_rng_state ^= g_rng_state << 5;
+    size_t interval = 1 + g_rng_state % (2UL * g_sample_rate);
+    heap_unlock(&g_lock);
+    return interval;
+}
+
+// Unmaps the pool and restores the previous SIGSEGV handler. Called with
+// g_lock held, once nothing references the pool any more.
+static void guarded_pool_unmap(void) {
+    if (g_guarded_pool.start) {
+        sigaction(SIGSEGV, &g_prev_segv, NULL);
+        if (munmap(g_guarded_pool.start, (size_t)(g_guarded_pool.end - g_guarded_pool.start)) == -1) {
+            perror("munmap failed during guarded pool cleanup");
+        }
+        memset(&g_guarded_pool, 0, sizeof(g_guarded_pool));
+    }
+}
+
+// Drops a reference to the pool, unmapping it with the last one. Called
+// with g_lock held.
+static void guarded_pool_unref(void) {
+    if (--g_refs == 0) guarded_pool_unmap();
+}
+
+// Sets up the pool and the fault handler. A sample_rate of 0 turns sampling
+// off; the pool stays until no instance has sampled blocks in it.
+int guarded_pool_init(unsigned int sample_rate) {
+    if (sample_rate == 0) {
+        heap_lock(&g_lock);
+        g_sample_rate = 0;
+        if (g_enabled) {
+            g_enabled = 0;
+            guarded_pool_unref();
+        }
+        heap_unlock(&g_lock);
+        return 0;
+    }
+
+    heap_lock(&g_lock);
+    if (!g_guarded_pool.start) {
+        size_t page_size = (size_t)sysconf(_SC_PAGESIZE);
+        size_t pool_size = (2 * GUARDED_POOL_SLOTS + 1) * page_size;
+
+        // Everything starts out inaccessible; slots are opened on allocation
+        void* pool = mmap(NULL, pool_size, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (pool == MAP_FAILED) {
+            heap_unlock(&g_lock);
+            perror("mmap failed for guarded pool");
+            return -1;
+        }
+
+        struct sigaction sa;
+        memset(&sa, 0, sizeof(sa));
+        sa.sa_sigaction = guarded_fault_handler;
+        sa.sa_flags = SA_SIGINFO | SA_ONSTACK;
+        sigemptyset(&sa.sa_mask);
+        if (sigaction(SIGSEGV, &sa, &g_prev_segv) == -1) {
+            heap_unlock(&g_lock);
+            perror("sigaction failed for guarded pool");
+            munmap(pool, pool_size);
+            return -1;
+        }
+
+        // backtrace() loads its unwinder lazily; do it now rather than on the first sample
+        void* warmup[1];
+        backtrace(warmup, 1);
+
+        memset(g_slots, 0, sizeof(g_slots));
+        g_next_slot = 0;
+        g_guarded_pool.start = (char*)pool;
+        g_guarded_pool.end = (char*)pool + pool_size;
+        g_guarded_pool.page_size = page_size;
+        g_guarded_pool.sampled_count = 0;
+        g_guarded_pool.live_count = 0;
+    }
+
+    if (!g_enabled) {
+        g_enabled = 1;
+        g_refs++;
+    }
+    g_sample_rate = sample_rate;
+    g_rng_state = (unsigned int)getpid() | 1;
+    heap_unlock(&g_lock);
+    return 0;
+}
+
+// Makes instance 'a' take part in sampling, if sampling is on. Returns 1 if
+// it does; it then holds a reference to the pool until guarded_pool_release().
+int guarded_pool_acquire(const allocator_t* a) {
+    (void)a;
+    heap_lock(&g_lock);
+    int joined = g_enabled;
+    if (joined) g_refs++;
+    heap_unlock(&g_lock);
+    return joined;
+}
+
+// Frees the slots still live from instance 'a', which is going away, and
+// drops its reference. The slots stay poisoned, so a pointer kept past the
+// instance's destruction still faults with a report.
+void guarded_pool_release(const allocator_t* a) {
+    void* stack[GUARDED_STACK_DEPTH];
+    int depth = backtrace(stack, GUARDED_STACK_DEPTH);
+
+    heap_lock(&g_lock);
+    for (size_t i = 0; i < GUARDED_POOL_SLOTS; i++) {
+        guarded_slot_t* slot = &g_slots[i];
+        if (slot->state != SLOT_LIVE || slot->owner != a) continue;
+
+        slot->state = SLOT_FREED;
+        memcpy(slot->free_stack, stack, sizeof(stack));
+        slot->free_depth = depth;
+        mprotect(slot_page(i), g_guarded_pool.page_size, PROT_NONE);
+        g_guarded_pool.live_count--;
+    }
+    guarded_pool_unref();
+    heap_unlock(&g_lock);
+}
+
+// Serves 'size' bytes for instance 'a' from a free slot. Returns NULL if the
+// request doesn't fit in a page or every slot is live; the caller then uses
+// the normal path.
+void* guarded_alloc_internal(const allocator_t* a, size_t size) {
+    if (size == 0 || size > g_guarded_pool.page_size) return NULL;
+
+    heap_lock(&g_lock);
+
+    // Pick the next non-live slot in round-robin order; since frees happen
+    // roughly in allocation order this reuses the oldest freed slot first.
+    guarded_slot_t* slot = NULL;
+    size_t index = 0;
+    for (size_t n = 0; n < GUARDED_POOL_SLOTS; n++) {
+        index = (g_next_slot + n) % GUARDED_POOL_SLOTS;
+        if (g_slots[index].state != SLOT_LIVE) {
+            slot = &g_slots[index];
+            break;
+        }
+    }
+    if (!slot) {
+        heap_unlock(&g_lock);
+        return NULL;
+    }
+
+    char* page = slot_page(index);
+    if (mprotect(page, g_guarded_pool.page_size, PROT_READ | PROT_WRITE) == -1) {
+        heap_unlock(&g_lock);
+        return NULL;
+    }
+    g_next_slot = index + 1;
+
+    // Alternate between placing the allocation against the right guard page
+    // (catches overflows) and the left one (catches underflows). Right-aligned
+    // blocks keep 8-byte alignment, so overflows smaller than the padding slip through.
+    char* addr;
+    if (g_guarded_pool.sampled_count % 2 == 0) {
+        addr = page + ((g_guarded_pool.page_size - size) & ~(size_t)7);
+    } else {
+        addr = page;
+    }
+
+    slot->state = SLOT_LIVE;
+    slot->owner = a;
+    slot->addr = addr;
+    slot->size = size;
+    slot->alloc_depth = backtrace(slot->alloc_stack, GUARDED_STACK_DEPTH);
+    slot->free_depth = 0;
+
+    g_guarded_pool.sampled_count++;
+    g_guarded_pool.live_count++;
+    heap_unlock(&g_lock);
+    return addr;
+}
+
+// Frees a sampled allocation and poisons its slot.
+void guarded_free_internal(void* ptr) {
+    size_t page = (size_t)((char*)ptr - g_guarded_pool.start) / g_guarded_pool.page_size;
+    guarded_slot_t* slot = page % 2 == 1 ? &g_slots[page / 2] : NULL;
+
+    heap_lock(&g_lock);
+    if (!slot || slot->addr != (char*)ptr || slot->state != SLOT_LIVE) {
+        heap_unlock(&g_lock);
+        fprintf(stderr, "\n=== Guarded pool: %s of %p ===\n",
+                slot && slot->addr == (char*)ptr && slot->state == SLOT_FREED ? "double free" : "invalid free",
+                ptr);
+        if (slot && slot->state != SLOT_EMPTY) {
+            report_slot(slot);
+        }
+        assert(0 && "Double free or invalid free of guarded allocation");
+        return;
+    }
+
+    slot->state = SLOT_FREED;
+    slot->free_depth = backtrace(slot->free_stack, GUARDED_STACK_DEPTH);
+    mprotect(slot_page(page / 2), g_guarded_pool.page_size, PROT_NONE);
+    g_guarded_pool.live_count--;
+    heap_unlock(&g_lock);
+}
+
+// Returns the requested size of a live sampled allocation (used by realloc).
+size_t guarded_usable_size(const void* ptr) {
+    size_t page = (size_t)((const char*)ptr - g_guarded_pool.start) / g_guarded_pool.page_size;
+    return g_slots[page / 2].size;
+}
+
+// Allocation tag of a sampled block, kept in its slot
+void guarded_set_tag(void* ptr, unsigned int tag) {
+    size_t page = (size_t)((char*)ptr - g_guarded_pool.start) / g_guarded_pool.page_size;
+    g_slots[page / 2].tag = tag;
+}
+
+unsigned int guarded_tag(const void* ptr) {
+    size_t page = (size_t)((const char*)ptr - g_guarded_pool.start) / g_guarded_pool.page_size;
+    return g_slots[page / 2].tag;
+}
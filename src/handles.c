@@ -0,0 +1,276 @@
+#define _GNU_SOURCE // For sched_yield
+#include "allocator.h"
+#include <stdio.h>
+#include <sched.h>
+#include <assert.h> // For debugging assertions
+
+// Movable allocations (handles)
+//
+// A handle names an entry in a table that holds the current offset of its
+// block. seg_compact() may move unpinned blocks of the segregated heap and
+// update their entries; the application only ever reaches the block through
+// the handle, by pinning it. An allocated segregated block keeps its entry's
+// index + 1 in the otherwise unused 'next' field of its header, so
+// compaction walking the heap can tell movable blocks from the rest.
+//
+// The table is split into chunks of HANDLE_CHUNK_ENTRIES entries, allocated
+// from the heap itself as they're needed and never moved or freed, so an
+// entry's address is stable and the table works for shared heaps too.
+// Unused entries are chained through their offset field.
+//
+// An entry's generation is odd while the handle is live and even while the
+// entry is unused, and is part of the handle, so stale handles are caught.
+// Its pin count doubles as a claim: HANDLE_BUSY while the block is being set
+// up, moved or freed. Pinning waits out a claim, and compaction skips blocks
+// it can't claim, which is what keeps pinned blocks in place.
+//
+// Locking: the table's free list and chunks are guarded by hdr->handle_lock
+// (ALLOCATOR_LOCK_FINE) or the global lock (ALLOCATOR_LOCK_GLOBAL). Pin
+// counts are updated atomically with either, and take no lock.
+
+#define HANDLE_BUSY UINT32_MAX
+#define HANDLE_SPIN_LIMIT 100 // Polls of a claimed entry before yielding (latency-critical heaps don't)
+
+static void table_lock(allocator_t* a) {
+    if (a->lock_mode == ALLOCATOR_LOCK_FINE) heap_lock(&a->hdr->handle_lock.word);
+}
+
+static void table_unlock(allocator_t* a) {
+    if (a->lock_mode == ALLOCATOR_LOCK_FINE) heap_unlock(&a->hdr->handle_lock.word);
+}
+
+// Entry 'index' of the table
+static handle_entry_t* entry_at(allocator_t* a, size_t index) {
+    handle_entry_t* chunk = (handle_entry_t*)HEAP_PTR(a, a->hdr->handle_chunks[index / HANDLE_CHUNK_ENTRIES]);
+    return &chunk[index % HANDLE_CHUNK_ENTRIES];
+}
+
+// Entry of a live handle, or NULL if the handle is invalid or stale
+static handle_entry_t* lookup(allocator_t* a, allocator_handle_t handle) {
+    size_t index = (size_t)(handle & 0xffffffffu);
+    uint32_t generation = (uint32_t)(handle >> 32);
+
+    size_t chunks = __atomic_load_n(&a->hdr->handle_chunk_count, __ATOMIC_ACQUIRE);
+    if (index == 0 || index > chunks * HANDLE_CHUNK_ENTRIES) return NULL;
+    handle_entry_t* entry = entry_at(a, index - 1);
+    if (__atomic_load_n(&entry->generation, __ATOMIC_RELAXED) != generation || !(generation & 1)) {
+        return NULL;
+    }
+    return entry;
+}
+
+// Claims an entry whose pin count is 0. Returns 0 if the entry is pinned
+// instead, or claimed by someone else and 'wait' isn't set. Compaction never
+// waits: it holds the class locks a claimed block may be waiting to be freed
+// under.
+static int claim_unpinned(allocator_t* a, handle_entry_t* entry, int wait) {
+    if (a->lock_mode == ALLOCATOR_LOCK_NONE) {
+        if (entry->pins != 0) return 0;
+        entry->pins = HANDLE_BUSY;
+        return 1;
+    }
+
+    uint32_t pins = __atomic_load_n(&entry->pins, __ATOMIC_RELAXED);
+    for (int spins = 0;; spins++) {
+        if (pins == HANDLE_BUSY) {
+            if (!wait) return 0;
+            if (spins >= HANDLE_SPIN_LIMIT && !a->latency_critical) sched_yield();
+            pins = __atomic_load_n(&entry->pins, __ATOMIC_RELAXED);
+            continue;
+        }
+        if (pins != 0) return 0;
+        if (__atomic_compare_exchange_n(&entry->pins, &pins, HANDLE_BUSY, 1,
+                                        __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+            return 1;
+        }
+    }
+}
+
+// Ends a claim, publishing whatever was changed under it
+static void unclaim(allocator_t* a, handle_entry_t* entry) {
+    if (a->lock_mode == ALLOCATOR_LOCK_NONE) {
+        entry->pins = 0;
+    } else {
+        __atomic_store_n(&entry->pins, 0, __ATOMIC_RELEASE);
+    }
+}
+
+// Takes an unused entry, adding a chunk to the table if there is none, and
+// claims it. Returns its index, or -1 if the table is full or the heap has
+// no room for another chunk.
+long handle_reserve(allocator_t* a) {
+    heap_header_t* hdr = a->hdr;
+
+    table_lock(a);
+    if (!hdr->handle_free) {
+        if (hdr->handle_chunk_count == HANDLE_MAX_CHUNKS) {
+            table_unlock(a);
+            return -1;
+        }
+        handle_entry_t* chunk = (handle_entry_t*)heap_alloc(a, HANDLE_CHUNK_ENTRIES * sizeof(handle_entry_t),
+                                                            LIFETIME_LONG);
+        if (!chunk) {
+            table_unlock(a);
+            return -1;
+        }
+
+        // Chain the new entries in index order
+        size_t first = hdr->handle_chunk_count * HANDLE_CHUNK_ENTRIES;
+        for (size_t i = 0; i < HANDLE_CHUNK_ENTRIES; i++) {
+            chunk[i].off = i + 1 < HANDLE_CHUNK_ENTRIES ? first + i + 2 : 0;
+            chunk[i].pins = 0;
+            chunk[i].generation = 0;
+        }
+        hdr->handle_chunks[hdr->handle_chunk_count] = HEAP_OFF(a, chunk);
+        __atomic_store_n(&hdr->handle_chunk_count, hdr->handle_chunk_count + 1, __ATOMIC_RELEASE);
+        hdr->handle_free = first + 1;
+    }
+
+    size_t index = hdr->handle_free - 1;
+    handle_entry_t* entry = entry_at(a, index);
+    hdr->handle_free = entry->off;
+    hdr->handle_count++;
+
+    entry->off = 0;
+    entry->pins = HANDLE_BUSY;
+    __atomic_store_n(&entry->generation, entry->generation + 1, __ATOMIC_RELAXED); // Odd: live
+    table_unlock(a);
+    return (long)index;
+}
+
+// Returns an entry to the unused list, invalidating its handle
+void handle_unreserve(allocator_t* a, size_t index) {
+    heap_header_t* hdr = a->hdr;
+    handle_entry_t* entry = entry_at(a, index);
+
+    table_lock(a);
+    __atomic_store_n(&entry->generation, entry->generation + 1, __ATOMIC_RELAXED); // Even: unused
+    entry->off = hdr->handle_free;
+    entry->pins = 0;
+    hdr->handle_free = index + 1;
+    hdr->handle_count--;
+    table_unlock(a);
+}
+
+// Points a reserved entry at its new block and ends the claim. Returns the
+// handle.
+allocator_handle_t handle_publish(allocator_t* a, size_t index, void* ptr) {
+    handle_entry_t* entry = entry_at(a, index);
+
+    entry->off = HEAP_OFF(a, ptr);
+    if ((char*)ptr > (char*)a->seg_heap && (char*)ptr < (char*)a->heap_end) {
+        ((block_t*)((char*)ptr - sizeof(block_t)))->next = index + 1; // Movable
+    }
+    unclaim(a, entry);
+    return ((allocator_handle_t)entry->generation << 32) | (index + 1);
+}
+
+// Claims a live handle's entry so its block can be freed. Returns the
+// block, or NULL if the handle is invalid or still pinned. The entry stays
+// claimed until handle_unreserve().
+void* handle_claim_for_free(allocator_t* a, allocator_handle_t handle, size_t* index) {
+    handle_entry_t* entry = lookup(a, handle);
+    if (!entry) {
+        fprintf(stderr, "Invalid or stale handle freed: %#llx\n", (unsigned long long)handle);
+        assert(0 && "Invalid or stale handle freed");
+        return NULL;
+    }
+    if (!claim_unpinned(a, entry, 1)) {
+        fprintf(stderr, "Handle freed while pinned: %#llx\n", (unsigned long long)handle);
+        assert(0 && "Handle freed while pinned");
+        return NULL;
+    }
+    *index = (size_t)(handle & 0xffffffffu) - 1;
+    return HEAP_PTR(a, entry->off);
+}
+
+// Pins a live handle's block in place and returns its address, or NULL if
+// the handle is invalid or stale
+void* handle_pin_internal(allocator_t* a, allocator_handle_t handle) {
+    handle_entry_t* entry = lookup(a, handle);
+    if (!entry) return NULL;
+
+    if (a->lock_mode == ALLOCATOR_LOCK_NONE) {
+        entry->pins++;
+        return HEAP_PTR(a, entry->off);
+    }
+
+    uint32_t pins = __atomic_load_n(&entry->pins, __ATOMIC_RELAXED);
+    for (int spins = 0;; spins++) {
+        if (pins == HANDLE_BUSY) {
+            // Being moved: wait for the move to finish
+            if (spins >= HANDLE_SPIN_LIMIT && !a->latency_critical) sched_yield();
+            pins = __atomic_load_n(&entry->pins, __ATOMIC_RELAXED);
+            continue;
+        }
+        if (__atomic_compare_exchange_n(&entry->pins, &pins, pins + 1, 1,
+                                        __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+            return HEAP_PTR(a, __atomic_load_n(&entry->off, __ATOMIC_RELAXED));
+        }
+    }
+}
+
+void handle_unpin_internal(allocator_t* a, allocator_handle_t handle) {
+    handle_entry_t* entry = lookup(a, handle);
+    uint32_t pins = entry ? __atomic_load_n(&entry->pins, __ATOMIC_RELAXED) : 0;
+
+    if (pins == 0 || pins == HANDLE_BUSY) {
+        fprintf(stderr, "Unpinning a handle that isn't pinned: %#llx\n", (unsigned long long)handle);
+        assert(0 && "Unpinning a handle that isn't pinned");
+        return;
+    }
+    if (a->lock_mode == ALLOCATOR_LOCK_NONE) {
+        entry->pins--;
+    } else {
+        __atomic_fetch_sub(&entry->pins, 1, __ATOMIC_RELEASE);
+    }
+}
+
+// Claims the handle of an allocated segregated block for moving. Returns
+// 0 if the block isn't movable or its handle is pinned.
+int handle_claim_block(allocator_t* a, block_t* block) {
+    size_t index = block->next;
+    size_t chunks = __atomic_load_n(&a->hdr->handle_chunk_count, __ATOMIC_ACQUIRE);
+    if (index == 0 || index > chunks * HANDLE_CHUNK_ENTRIES) return 0;
+
+    handle_entry_t* entry = entry_at(a, index - 1);
+    if (!claim_unpinned(a, entry, 0)) return 0;
+    if (HEAP_PTR(a, entry->off) != (void*)((char*)block + sizeof(block_t))) {
+        unclaim(a, entry); // Not the block this entry is for
+        return 0;
+    }
+    return 1;
+}
+
+// Records that a claimed block now lives at 'block' and ends the claim
+void handle_moved(allocator_t* a, block_t* block) {
+    handle_entry_t* entry = entry_at(a, block->next - 1);
+    __atomic_store_n(&entry->off, HEAP_OFF(a, (char*)block + sizeof(block_t)), __ATOMIC_RELAXED);
+    unclaim(a, entry);
+}
+
+// Counts inconsistencies in the handle table: live entries that don't
+// point at an allocated block of theirs, or a count that doesn't match.
+// Caller holds every lock.
+int handle_check(allocator_t* a) {
+    heap_header_t* hdr = a->hdr;
+    int problems = 0;
+    size_t live = 0;
+
+    if (hdr->handle_chunk_count > HANDLE_MAX_CHUNKS) return 1;
+    for (size_t index = 0; index < hdr->handle_chunk_count * HANDLE_CHUNK_ENTRIES; index++) {
+        handle_entry_t* entry = entry_at(a, index);
+        if (!(entry->generation & 1)) continue;
+        live++;
+        if (entry->pins == HANDLE_BUSY) continue; // Being set up
+
+        if (entry->off < hdr->buddy_heap || entry->off >= hdr->heap_size) {
+            problems++;
+        } else if (entry->off > hdr->seg_heap) {
+            block_t* block = (block_t*)((char*)HEAP_PTR(a, entry->off) - sizeof(block_t));
+            if (block->free || block->next != index + 1) problems++;
+        }
+    }
+    if (live != hdr->handle_count) problems++;
+    return problems;
+}
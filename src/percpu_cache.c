@@ -0,0 +1,388 @@
+#define _GNU_SOURCE // For MAP_ANONYMOUS
+#include "allocator.h"
+#include <stdio.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <linux/membarrier.h>
+
+// Per-CPU caches of segregated blocks (allocator_config_t.percpu_cache_limit)
+//
+// Each CPU keeps a small stack of freed blocks per size class, so most
+// allocations and frees of small blocks never reach the segregated lists or
+// their locks. A thread always uses the cache of the CPU it is running on,
+// so memory held in caches is bounded by the number of CPUs, however many
+// threads there are.
+//
+// The stacks are updated with restartable sequences (rseq): a short
+// instruction sequence that reads the current CPU, checks the stack and ends
+// in a single store to its count. If the thread is preempted, migrated or
+// signalled before that store, the kernel moves it to an abort handler that
+// starts the sequence over, so no other thread can interleave with it and
+// neither atomics nor locks are needed. Without rseq (kernel or C library
+// too old, or not x86_64) the caches are left off and everything takes the
+// locked path.
+//
+// The caches live in a process-local mapping laid out per CPU, each CPU's
+// caches on their own cache lines:
+//
+//   [cpu 0: count|slots of class 0, count|slots of class 1, ...][cpu 1: ...]
+//
+// A stack's count word keeps the number of blocks in its low 16 bits and
+// the number of pops in the rest, so a pop moves both with its one store.
+// Pushes are the pops plus the blocks still there. The allocation and free
+// counts add these up, without a store or atomic of their own on the fast
+// path.
+//
+// Cached blocks are exactly their class's size and stay allocated as far as
+// the segregated lists and the byte counts are concerned. When an
+// allocation fails, every CPU's caches are flushed back. A flushing thread
+// sets PERCPU_STOPPED in the count words, which makes every pop and push
+// miss, then fences with membarrier(MEMBARRIER_CMD_PRIVATE_EXPEDITED_RSEQ):
+// that restarts any sequence still running on the old count, and is why the
+// caches are left off where the kernel doesn't have it. A sequence that
+// committed before the fence may have stored over the bit, so it's checked
+// again and the fence repeated until every bit holds.
+//
+// Latency-critical heaps make no system calls, so they can't fence. Their
+// limit is shared out between the CPUs instead, bounding what the whole
+// heap caches, and a failing allocation pops the current CPU's caches
+// empty. Those pops aren't allocations, so they're counted apart and taken
+// off again.
+
+#if defined(__x86_64__) && defined(__GLIBC__) && defined(__has_include)
+#if __has_include(<sys/rseq.h>)
+#include <sys/rseq.h>
+#define PERCPU_RSEQ 1
+#endif
+#endif
+
+#define PERCPU_COUNT_MASK 0xffffULL // Blocks on the stack, with PERCPU_STOPPED
+#define PERCPU_STOPPED    0x8000ULL // Flush in progress: every pop and push misses
+#define PERCPU_POP_SHIFT  16        // Pops are counted above the blocks
+
+#define PERCPU_STR_(x) #x
+#define PERCPU_STR(x) PERCPU_STR_(x)
+
+#ifdef PERCPU_RSEQ
+
+// This thread's rseq area, registered by the C library at thread start
+static struct rseq* rseq_area(void) {
+    return (struct rseq*)((char*)__builtin_thread_pointer() + __rseq_offset);
+}
+
+// Pops a block off the current CPU's stack for the class whose stack in
+// CPU 0's cache is at 'stack'. Returns NULL if the stack is empty or
+// stopped, or the CPU has no cache.
+//
+// Labels: 1-2 is the critical section, ending with the store of the count;
+// 3 its descriptor; 4 the abort handler, preceded by the signature the
+// kernel checks, which starts over at 6 (the kernel clears rseq_cs on abort).
+static void* rseq_pop(struct rseq* rs, char* stack, size_t stride, uint32_t cpus) {
+    void* ptr;
+
+    __asm__ __volatile__(
+        ".pushsection __rseq_cs, \"aw\"\n\t"
+        ".balign 32\n\t"
+        "3:\n\t"
+        ".long 0x0, 0x0\n\t"
+        ".quad 1f, 2f - 1f, 4f\n\t"
+        ".popsection\n\t"
+        "6:\n\t"
+        "leaq 3b(%%rip), %%rax\n\t"
+        "movq %%rax, %[rseq_cs]\n\t"
+        "1:\n\t"
+        "xorl %k[ptr], %k[ptr]\n\t"
+        "movl %[cpu_id], %%eax\n\t"
+        "cmpl %[cpus], %%eax\n\t"
+        "jae 2f\n\t"
+        "imulq %[stride], %%rax\n\t"
+        "addq %[stack], %%rax\n\t"
+        "movq (%%rax), %%rcx\n\t"               // Count word
+        "movzwl %%cx, %%edx\n\t"
+        "subl $1, %%edx\n\t"                     // Misses if empty or stopped
+        "cmpl $0x7fff, %%edx\n\t"
+        "jae 2f\n\t"
+        "movq 8(%%rax, %%rdx, 8), %[ptr]\n\t"   // slots[count - 1]
+        "addq $0xffff, %%rcx\n\t"               // One block less, one pop more
+        "movq %%rcx, (%%rax)\n\t"               // Commit
+        "2:\n\t"
+        ".pushsection __rseq_failure, \"ax\"\n\t"
+        ".byte 0x0f, 0xb9, 0x3d\n\t"
+        ".long " PERCPU_STR(RSEQ_SIG) "\n\t"
+        "4:\n\t"
+        "jmp 6b\n\t"
+        ".popsection\n\t"
+        : [ptr] "=&r" (ptr), [rseq_cs] "=m" (rs->rseq_cs)
+        : [cpu_id] "m" (rs->cpu_id), [cpus] "r" (cpus),
+          [stride] "r" (stride), [stack] "r" (stack)
+        : "rax", "rcx", "rdx", "memory", "cc");
+    return ptr;
+}
+
+// Pushes 'ptr' onto the current CPU's stack of at most 'capacity' blocks
+// (fewer than PERCPU_STOPPED). Returns 0 if the stack is full or stopped,
+// or the CPU has no cache. The slot is written before the count, so an
+// aborted push leaves nothing behind.
+static int rseq_push(struct rseq* rs, char* stack, size_t stride, uint32_t cpus,
+                     size_t capacity, void* ptr) {
+    int pushed;
+
+    __asm__ __volatile__(
+        ".pushsection __rseq_cs, \"aw\"\n\t"
+        ".balign 32\n\t"
+        "3:\n\t"
+        ".long 0x0, 0x0\n\t"
+        ".quad 1f, 2f - 1f, 4f\n\t"
+        ".popsection\n\t"
+        "6:\n\t"
+        "leaq 3b(%%rip), %%rax\n\t"
+        "movq %%rax, %[rseq_cs]\n\t"
+        "1:\n\t"
+        "xorl %[pushed], %[pushed]\n\t"
+        "movl %[cpu_id], %%eax\n\t"
+        "cmpl %[cpus], %%eax\n\t"
+        "jae 2f\n\t"
+        "imulq %[stride], %%rax\n\t"
+        "addq %[stack], %%rax\n\t"
+        "movq (%%rax), %%rcx\n\t"               // Count word
+        "movzwl %%cx, %%edx\n\t"
+        "cmpq %[capacity], %%rdx\n\t"           // Misses if full or stopped
+        "jae 2f\n\t"
+        "movq %[block], 8(%%rax, %%rdx, 8)\n\t" // slots[count]
+        "addq $1, %%rcx\n\t"
+        "movl $1, %[pushed]\n\t"
+        "movq %%rcx, (%%rax)\n\t"               // Commit
+        "2:\n\t"
+        ".pushsection __rseq_failure, \"ax\"\n\t"
+        ".byte 0x0f, 0xb9, 0x3d\n\t"
+        ".long " PERCPU_STR(RSEQ_SIG) "\n\t"
+        "4:\n\t"
+        "jmp 6b\n\t"
+        ".popsection\n\t"
+        : [pushed] "=&r" (pushed), [rseq_cs] "=m" (rs->rseq_cs)
+        : [cpu_id] "m" (rs->cpu_id), [cpus] "r" (cpus), [stride] "r" (stride),
+          [stack] "r" (stack), [capacity] "r" (capacity), [block] "r" (ptr)
+        : "rax", "rcx", "rdx", "memory", "cc");
+    return pushed;
+}
+
+#endif // PERCPU_RSEQ
+
+// Sets up an instance's per-CPU caches, keeping at most 'limit' blocks per
+// size class per CPU, or per heap if it's latency-critical (and no more than
+// PERCPU_CACHE_BYTES of any class).
+// Leaves them off, and returns 0, if 'limit' is 0, the engine has no
+// segregated heap or rseq isn't available. Returns -1 on failure.
+int percpu_cache_init(allocator_t* a, size_t limit) {
+    a->percpu_base = NULL;
+    a->percpu_classes = 0;
+    if (limit == 0) return 0;
+    if (a->hdr->engine != ALLOCATOR_ENGINE_HYBRID && a->hdr->engine != ALLOCATOR_ENGINE_SEGREGATED) {
+        return 0;
+    }
+
+#ifdef PERCPU_RSEQ
+    if (__rseq_size == 0) return 0; // Not registered, e.g. glibc.pthread.rseq=0
+
+    // Flushes need the fence. Registering for it is per process and may be
+    // repeated.
+    if (!a->latency_critical &&
+        syscall(SYS_membarrier, MEMBARRIER_CMD_REGISTER_PRIVATE_EXPEDITED_RSEQ, 0, 0) != 0) {
+        return 0;
+    }
+
+    long cpus = sysconf(_SC_NPROCESSORS_CONF);
+    if (cpus < 1) return 0;
+    if (a->latency_critical) limit = (limit + (size_t)cpus - 1) / (size_t)cpus;
+
+    int classes = seg_served_classes(a);
+    if (classes == 0) return 0;
+
+    size_t stride = 0;
+    for (int i = 0; i < classes; i++) {
+        size_t capacity = PERCPU_CACHE_BYTES / a->class_sizes[i];
+        if (capacity > limit) capacity = limit;
+        if (capacity == 0) capacity = 1;
+        a->percpu_capacity[i] = capacity;
+        a->percpu_offset[i] = stride;
+        stride += sizeof(uint64_t) + capacity * sizeof(void*); // Count, then slots
+    }
+    stride = (stride + CACHE_LINE_SIZE - 1) & ~(size_t)(CACHE_LINE_SIZE - 1);
+
+    // Zero-filled, so every stack starts out empty. Faulted in now for a
+    // latency-critical heap, like the heap itself.
+    size_t size = stride * (size_t)cpus;
+    int flags = MAP_PRIVATE | MAP_ANONYMOUS | (a->latency_critical ? MAP_POPULATE : 0);
+    void* base = mmap(NULL, size, PROT_READ | PROT_WRITE, flags, -1, 0);
+    if (base == MAP_FAILED) {
+        perror("mmap failed for per-CPU caches");
+        return -1;
+    }
+
+    a->percpu_base = (char*)base;
+    a->percpu_size = size;
+    a->percpu_stride = stride;
+    a->percpu_cpus = (uint32_t)cpus;
+    a->percpu_classes = classes;
+    a->percpu_flushed = 0;
+    heap_lock_init(&a->percpu_lock, HEAP_LOCK_SLEEP);
+#endif
+    return 0;
+}
+
+// Unmaps an instance's per-CPU caches. Blocks still cached go with the heap.
+void percpu_cache_release(allocator_t* a) {
+    if (!a->percpu_base) return;
+    if (munmap(a->percpu_base, a->percpu_size) == -1) {
+        perror("munmap failed for per-CPU caches");
+    }
+    a->percpu_base = NULL;
+}
+
+// Takes a block of size class 'class_idx' from the current CPU's cache.
+// Returns NULL on a miss.
+void* percpu_cache_pop(allocator_t* a, size_t class_idx) {
+#ifdef PERCPU_RSEQ
+    return rseq_pop(rseq_area(), a->percpu_base + a->percpu_offset[class_idx],
+                    a->percpu_stride, a->percpu_cpus);
+#else
+    (void)a;
+    (void)class_idx;
+    return NULL;
+#endif
+}
+
+// Puts an allocated segregated block of 'block_size' bytes, header
+// included, on the current CPU's cache. Only blocks of exactly a cached
+// class's size are taken. Returns 1 if the block was cached.
+int percpu_cache_push(allocator_t* a, void* ptr, size_t block_size) {
+    size_t payload = block_size - sizeof(block_t);
+    if (payload < MIN_BLOCK_SIZE || (payload & (payload - 1)) != 0) return 0;
+
+    size_t class_idx = (size_t)__builtin_ctzl(payload) - 4; // MIN_BLOCK_SIZE is 2^4
+    if (class_idx >= (size_t)a->percpu_classes) return 0;
+
+#ifdef PERCPU_RSEQ
+    return rseq_push(rseq_area(), a->percpu_base + a->percpu_offset[class_idx],
+                     a->percpu_stride, a->percpu_cpus, a->percpu_capacity[class_idx], ptr);
+#else
+    (void)ptr;
+    return 0;
+#endif
+}
+
+// Count word of the stack of class 'class_idx' in 'cpu's caches
+static uint64_t* percpu_word(const allocator_t* a, uint32_t cpu, int class_idx) {
+    return (uint64_t*)(a->percpu_base + cpu * a->percpu_stride + a->percpu_offset[class_idx]);
+}
+
+// Frees the blocks in a CPU's caches back to the segregated lists
+static void percpu_free_blocks(allocator_t* a, void** slots, size_t count) {
+    for (size_t k = 0; k < count; k++) {
+        ((block_t*)((char*)slots[k] - sizeof(block_t)))->free = 0;
+        if (a->lock_mode == ALLOCATOR_LOCK_GLOBAL) heap_lock(&a->hdr->lock);
+        seg_free_internal(a, slots[k]);
+        if (a->lock_mode == ALLOCATOR_LOCK_GLOBAL) heap_unlock(&a->hdr->lock);
+    }
+}
+
+// Frees every block in every CPU's caches back to the segregated lists, or
+// only in the current CPU's on a latency-critical heap. Returns the number
+// of blocks freed.
+size_t percpu_cache_drain(allocator_t* a) {
+    size_t drained = 0;
+
+#ifdef PERCPU_RSEQ
+    if (a->latency_critical) {
+        for (int i = 0; i < a->percpu_classes; i++) {
+            void* ptr;
+            while ((ptr = percpu_cache_pop(a, (size_t)i)) != NULL) {
+                percpu_free_blocks(a, &ptr, 1);
+                drained++;
+            }
+        }
+        __atomic_fetch_add(&a->percpu_flushed, drained, __ATOMIC_RELAXED);
+        return drained;
+    }
+
+    heap_lock(&a->percpu_lock);
+
+    // Stop every stack, fencing until no sequence has stored over a stop
+    int stopped;
+    do {
+        for (uint32_t cpu = 0; cpu < a->percpu_cpus; cpu++) {
+            for (int i = 0; i < a->percpu_classes; i++) {
+                __atomic_fetch_or(percpu_word(a, cpu, i), PERCPU_STOPPED, __ATOMIC_RELAXED);
+            }
+        }
+        if (syscall(SYS_membarrier, MEMBARRIER_CMD_PRIVATE_EXPEDITED_RSEQ, 0, 0) != 0) {
+            perror("membarrier failed flushing per-CPU caches");
+            for (uint32_t cpu = 0; cpu < a->percpu_cpus; cpu++) {
+                for (int i = 0; i < a->percpu_classes; i++) {
+                    __atomic_fetch_and(percpu_word(a, cpu, i), ~PERCPU_STOPPED, __ATOMIC_RELEASE);
+                }
+            }
+            heap_unlock(&a->percpu_lock);
+            return 0;
+        }
+        stopped = 1;
+        for (uint32_t cpu = 0; cpu < a->percpu_cpus; cpu++) {
+            for (int i = 0; i < a->percpu_classes; i++) {
+                if (!(__atomic_load_n(percpu_word(a, cpu, i), __ATOMIC_RELAXED) & PERCPU_STOPPED)) stopped = 0;
+            }
+        }
+    } while (!stopped);
+
+    // Every pop and push now misses, so the stacks are this thread's alone
+    for (uint32_t cpu = 0; cpu < a->percpu_cpus; cpu++) {
+        for (int i = 0; i < a->percpu_classes; i++) {
+            uint64_t* word = percpu_word(a, cpu, i);
+            uint64_t value = __atomic_load_n(word, __ATOMIC_RELAXED);
+            size_t count = value & PERCPU_COUNT_MASK & ~PERCPU_STOPPED;
+
+            percpu_free_blocks(a, (void**)(word + 1), count);
+            drained += count;
+
+            // Empty and running again. The pops stay: the lists counted
+            // these frees again, so the pushes they imply drop by as many.
+            __atomic_store_n(word, value & ~PERCPU_COUNT_MASK, __ATOMIC_RELEASE);
+        }
+    }
+
+    heap_unlock(&a->percpu_lock);
+#else
+    (void)a;
+#endif
+    return drained;
+}
+
+// Bytes in blocks held in every CPU's caches, headers included. While
+// other threads are running this is a close snapshot, not an exact one.
+size_t percpu_cached_bytes(const allocator_t* a) {
+    size_t bytes = 0;
+
+    for (uint32_t cpu = 0; a->percpu_base && cpu < a->percpu_cpus; cpu++) {
+        for (int i = 0; i < a->percpu_classes; i++) {
+            uint64_t value = __atomic_load_n(percpu_word(a, cpu, i), __ATOMIC_RELAXED);
+            bytes += (value & PERCPU_COUNT_MASK & ~PERCPU_STOPPED) * (a->class_sizes[i] + sizeof(block_t));
+        }
+    }
+    return bytes;
+}
+
+// Adds the allocations and frees the caches served to 'allocs' and 'frees'.
+// The lists counted the flushed blocks' frees again.
+void percpu_cache_counts(const allocator_t* a, size_t* allocs, size_t* frees) {
+    size_t flushed = __atomic_load_n(&a->percpu_flushed, __ATOMIC_RELAXED);
+    *allocs -= flushed;
+    *frees -= flushed;
+    for (uint32_t cpu = 0; a->percpu_base && cpu < a->percpu_cpus; cpu++) {
+        for (int i = 0; i < a->percpu_classes; i++) {
+            uint64_t value = __atomic_load_n(percpu_word(a, cpu, i), __ATOMIC_RELAXED);
+            size_t pops = (size_t)(value >> PERCPU_POP_SHIFT);
+            *allocs += pops;
+            *frees += pops + (size_t)(value & PERCPU_COUNT_MASK & ~PERCPU_STOPPED);
+        }
+    }
+}
@@ -1,91 +1,463 @@
+#define _GNU_SOURCE // For madvise
 #include "allocator.h" // Includes allocator_t and block_t definitions
 #include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
 #include <assert.h> // For debugging assertions
 
 // Forward declarations for utility functions
 extern size_t align_size(size_t size);
-extern size_t get_size_class_index(size_t size);
+extern size_t get_size_class_index(const allocator_t* a, size_t size);
+
+// Size class list a free block of 'size' bytes belongs on. Latency-critical
+// heaps list a block under the largest class size it covers instead, so any
+// block on a class's list fits a request rounded up to that class.
+static size_t seg_class_of(const allocator_t* a, size_t size) {
+    size_t class_idx = get_size_class_index(a, size);
+    if (class_idx >= NUM_SIZE_CLASSES) {
+        class_idx = NUM_SIZE_CLASSES - 1; // Cap to the largest class
+    }
+    if (a->latency_critical && class_idx > 0 && size < a->class_sizes[class_idx]) {
+        class_idx--;
+    }
+    return class_idx;
+}
+
+// Locking (ALLOCATOR_LOCK_FINE)
+//
+// Every size class has its own lock, covering that class's list in each
+// lifetime. A block is only marked free while it's on a list, and a thread
+// holds at most one class lock at a time: a block that is split is taken off
+// its list under its class's lock, and the pieces that stay free are listed
+// afterwards under theirs. The exceptions are seg_coalesce() and
+// seg_compact(), which walk the whole heap, and seg_merge_lifetime(), which
+// walks one lifetime's lists; they take every class lock, in ascending order.
+
+static void class_lock(allocator_t* a, size_t class_idx) {
+    if (a->lock_mode == ALLOCATOR_LOCK_FINE) heap_lock(&a->hdr->seg_locks[class_idx].word);
+}
+
+static void class_unlock(allocator_t* a, size_t class_idx) {
+    if (a->lock_mode == ALLOCATOR_LOCK_FINE) heap_unlock(&a->hdr->seg_locks[class_idx].word);
+}
+
+// Pushes a free block onto the head of its lifetime's list for its size class
+static void seg_list_push(allocator_t* a, block_t* block) {
+    heap_off_t* list = &a->hdr->size_classes[block->lifetime][seg_class_of(a, block->size)];
+    heap_off_t head = *list;
+
+    block->next = head;
+    block->prev = 0;
+    if (head) {
+        ((block_t*)HEAP_PTR(a, head))->prev = HEAP_OFF(a, block);
+    }
+    *list = HEAP_OFF(a, block);
+}
+
+// Marks a block free and lists it, under its class's lock
+static void seg_release(allocator_t* a, block_t* block) {
+    size_t class_idx = seg_class_of(a, block->size);
+
+    class_lock(a, class_idx);
+    block->free = 1;
+    seg_list_push(a, block);
+    class_unlock(a, class_idx);
+}
+
+// Unlinks a free block from its list
+static void seg_list_remove(allocator_t* a, block_t* block) {
+    if (block->prev) {
+        ((block_t*)HEAP_PTR(a, block->prev))->next = block->next;
+    } else {
+        a->hdr->size_classes[block->lifetime][seg_class_of(a, block->size)] = block->next;
+    }
+    if (block->next) {
+        ((block_t*)HEAP_PTR(a, block->next))->prev = block->prev;
+    }
+}
+
+// Creates the initial free block covering the whole segregated list heap
+void seg_heap_init(allocator_t* a) {
+    heap_header_t* hdr = a->hdr;
+    if (hdr->seg_heap_size < sizeof(block_t) + MIN_BLOCK_SIZE) return; // No segregated heap
+
+    // The whole heap starts out in the general lists; hinted lifetimes
+    // take spans from it as they need them
+    block_t* initial_seg_block = (block_t*)a->seg_heap;
+    initial_seg_block->size = hdr->seg_heap_size;
+    initial_seg_block->free = 1;
+    initial_seg_block->lifetime = LIFETIME_GENERAL;
+    seg_list_push(a, initial_seg_block);
+}
+
+// Number of size classes, from the smallest, whose requests are served by
+// the segregated lists: all of them, or in a hybrid heap those below the
+// large threshold
+int seg_served_classes(const allocator_t* a) {
+    if (a->hdr->engine == ALLOCATOR_ENGINE_SEGREGATED) return NUM_SIZE_CLASSES;
+    if (a->hdr->engine != ALLOCATOR_ENGINE_HYBRID) return 0;
+
+    int classes = 0;
+    while (classes < NUM_SIZE_CLASSES &&
+           a->class_sizes[classes] <= a->hdr->large_threshold - sizeof(buddy_node_t)) {
+        classes++;
+    }
+    return classes;
+}
+
+// Removes a free block of at least 'size' bytes from a lifetime's lists and
+// splits off the excess. The returned block is taken from the front of the
+// free block, or from its end if 'from_end' is set, and is marked allocated.
+static block_t* seg_take(allocator_t* a, int lifetime, size_t size, int from_end) {
+    heap_header_t* hdr = a->hdr;
 
-// Segregated list allocation (internal)
-void* seg_alloc_internal(size_t size) {
-    // Align requested size and add space for the block_t header
-    size = align_size(size + sizeof(block_t));
-    
     // Determine the initial size class to search
-    size_t class_idx = get_size_class_index(size);
-    
+    size_t class_idx = get_size_class_index(a, size);
+
     // Look for a suitable block starting from the appropriate size class
     // and moving to larger classes if necessary (first-fit within classes, then best-fit across classes implicitly)
     for (size_t i = class_idx; i < NUM_SIZE_CLASSES; i++) {
-        block_t* block = g_allocator.size_classes[i];
-        
+        // Lists that look empty aren't worth locking
+        if (__atomic_load_n(&hdr->size_classes[lifetime][i], __ATOMIC_RELAXED) == 0) continue;
+
+        class_lock(a, i);
+        block_t* block = (block_t*)HEAP_PTR(a, hdr->size_classes[lifetime][i]);
+
         while (block) {
             if (block->free && block->size >= size) {
                 // Found a suitable free block
-                
+
                 // Remove from its current free list
-                if (block->prev) {
-                    block->prev->next = block->next;
-                } else {
-                    g_allocator.size_classes[i] = block->next;
-                }
-                if (block->next) {
-                    block->next->prev = block->prev;
-                }
-                
+                seg_list_remove(a, block);
+                block->free = 0;
+                block_t* remainder = NULL; // Piece split off that stays free
+
                 // Split block if it's significantly larger
                 // We split if the remainder is large enough to form a new usable free block (at least MIN_BLOCK_SIZE + header)
                 if (block->size >= size + sizeof(block_t) + MIN_BLOCK_SIZE) {
-                    block_t* new_block = (block_t*)((char*)block + size);
-                    new_block->size = block->size - size;
-                    new_block->free = 1;
-                    new_block->next = NULL;
-                    new_block->prev = NULL;
-                    
-                    // Add remainder to appropriate size class
-                    size_t new_class_idx = get_size_class_index(new_block->size);
-                    if (new_class_idx >= NUM_SIZE_CLASSES) {
-                        new_class_idx = NUM_SIZE_CLASSES - 1; // Cap to the largest class
-                    }
-                    
-                    // Add to the head of the new block's free list
-                    new_block->next = g_allocator.size_classes[new_class_idx];
-                    new_block->prev = NULL;
-                    if (g_allocator.size_classes[new_class_idx]) {
-                        g_allocator.size_classes[new_class_idx]->prev = new_block;
+                    block_t* new_block;
+                    if (from_end) {
+                        // Keep the front free and hand out the tail
+                        new_block = (block_t*)((char*)block + block->size - size);
+                        new_block->size = size;
+                        new_block->free = 0;
+                        new_block->lifetime = block->lifetime;
+                        block->size -= size;
+                        remainder = block;
+                        block = new_block;
+                    } else {
+                        new_block = (block_t*)((char*)block + size);
+                        new_block->size = block->size - size;
+                        new_block->free = 0;
+                        new_block->lifetime = block->lifetime;
+                        remainder = new_block;
+
+                        block->size = size; // The current block now has the requested size
                     }
-                    g_allocator.size_classes[new_class_idx] = new_block;
-                    
-                    block->size = size; // The current block now has the requested size
                 } else {
                     // If not splitting, the entire block is used, leading to internal fragmentation
-                    // g_allocator.fragmentation_count++; // Could increment fragmentation here
+                    // hdr->fragmentation_count++; // Could increment fragmentation here
                 }
-                
-                block->free = 0; // Mark as allocated
-                block->next = NULL; // Clear list pointers
-                block->prev = NULL;
-                
-                g_allocator.allocation_count++;
-                g_allocator.total_allocated += block->size;
-                g_allocator.total_free -= block->size;
-                
-                return (char*)block + sizeof(block_t); // Return pointer to user data
+
+                block->next = 0; // Clear list links
+                block->prev = 0;
+                class_unlock(a, i);
+
+                // Add remainder to the head of its size class list. Until
+                // then it's marked allocated, so seg_coalesce leaves it alone.
+                if (remainder) {
+                    seg_release(a, remainder);
+                }
+                return block;
             }
-            block = block->next;
+            block = (block_t*)HEAP_PTR(a, block->next);
         }
+        class_unlock(a, i);
     }
-    
-    // No suitable block found in segregated lists
+
+    // No suitable block found in this lifetime's lists
     return NULL;
 }
 
+// Moves a span of free space from the general lists to a hinted lifetime's
+// lists. Long-lived spans are cut from the end of general free blocks, so
+// they collect at the top of the heap, away from transient allocations.
+static int seg_refill(allocator_t* a, int lifetime, size_t size) {
+    size_t span_size = size > SEG_SPAN_SIZE ? size : SEG_SPAN_SIZE;
+
+    block_t* span = seg_take(a, LIFETIME_GENERAL, span_size, lifetime == LIFETIME_LONG);
+    if (!span && span_size > size) {
+        span = seg_take(a, LIFETIME_GENERAL, size, lifetime == LIFETIME_LONG);
+    }
+    if (!span) return 0;
+
+    span->lifetime = lifetime;
+    seg_release(a, span);
+    return 1;
+}
+
+// Merges the free blocks on a hinted lifetime's lists with the free blocks
+// of the same lifetime right after them, so space its own frees returned is
+// reused before it takes another span. Only walks that lifetime's lists,
+// not the heap. Returns the number of blocks merged away.
+static size_t seg_merge_lifetime(allocator_t* a, int lifetime) {
+    heap_header_t* hdr = a->hdr;
+    char* end = (char*)a->heap_end;
+    size_t merged = 0;
+
+    // Lists of every class change, so take every class lock (in ascending order)
+    for (size_t i = 0; i < NUM_SIZE_CLASSES; i++) {
+        class_lock(a, i);
+    }
+
+    for (size_t i = 0; i < NUM_SIZE_CLASSES; i++) {
+        block_t* block = (block_t*)HEAP_PTR(a, hdr->size_classes[lifetime][i]);
+        while (block) {
+            size_t size = block->size;
+            while ((char*)block + size < end) {
+                block_t* next = (block_t*)((char*)block + size);
+                if (next->free != 1 || next->lifetime != lifetime) break;
+                seg_list_remove(a, next);
+                size += next->size;
+                merged++;
+            }
+
+            // The merged blocks are gone from the lists, so the block's
+            // successor is still listed; a grown block may move to a larger
+            // class, whose list is walked later
+            block_t* successor = (block_t*)HEAP_PTR(a, block->next);
+            if (size != block->size) {
+                seg_list_remove(a, block);
+                block->size = size;
+                seg_list_push(a, block);
+            }
+            block = successor;
+        }
+    }
+
+    // Merging removed block boundaries the compaction cursor may be on
+    if (merged) hdr->compact_cursor = 0;
+
+    for (size_t i = NUM_SIZE_CLASSES; i-- > 0;) {
+        class_unlock(a, i);
+    }
+    return merged;
+}
+
+// Merges runs of physically adjacent free blocks. Blocks are only merged
+// into a hinted lifetime's lists if the whole run belongs to it; mixed runs
+// go back to the general lists. Returns the number of blocks merged away.
+size_t seg_coalesce(allocator_t* a) {
+    heap_header_t* hdr = a->hdr;
+    if (hdr->seg_heap_size < sizeof(block_t) + MIN_BLOCK_SIZE) return 0;
+
+    // Every list may change, so take every class lock (in ascending order)
+    for (size_t i = 0; i < NUM_SIZE_CLASSES; i++) {
+        class_lock(a, i);
+    }
+
+    // Segregated blocks tile their heap, so they can be walked by size
+    char* end = (char*)a->heap_end;
+    char* pos = (char*)a->seg_heap;
+    size_t merged = 0;
+
+    while (pos < end) {
+        block_t* block = (block_t*)pos;
+
+        if (block->free == 1) {
+            char* run_end = pos + block->size;
+            int lifetime = block->lifetime;
+            size_t run_merged = 0;
+
+            while (run_end < end && ((block_t*)run_end)->free == 1) {
+                block_t* next = (block_t*)run_end;
+                if (run_merged == 0) {
+                    seg_list_remove(a, block);
+                }
+                seg_list_remove(a, next);
+                if (next->lifetime != lifetime) {
+                    lifetime = LIFETIME_GENERAL;
+                }
+                run_end += next->size;
+                run_merged++;
+            }
+
+            if (run_merged) {
+                block->size = (size_t)(run_end - pos);
+                block->lifetime = lifetime;
+                seg_list_push(a, block);
+                merged += run_merged;
+            }
+        }
+        pos += block->size;
+    }
+
+    // Merging removed block boundaries the compaction cursor may be on
+    if (merged) hdr->compact_cursor = 0;
+
+    for (size_t i = NUM_SIZE_CLASSES; i-- > 0;) {
+        class_unlock(a, i);
+    }
+    return merged;
+}
+
+// Gives the pages inside a free block back to the OS. They read as zeros
+// when next touched, which is fine for free space; the header stays. Only
+// for private heaps, where that drops them from memory, and not for
+// latency-critical ones, which keep their pages and make no syscalls.
+static void seg_release_pages(allocator_t* a, block_t* block) {
+    if (a->shared || a->latency_critical || block->size < SEG_RELEASE_MIN) return;
+
+    uintptr_t page_size = (uintptr_t)sysconf(_SC_PAGESIZE);
+    uintptr_t start = ((uintptr_t)block + sizeof(block_t) + page_size - 1) & ~(page_size - 1);
+    uintptr_t end = ((uintptr_t)block + block->size) & ~(page_size - 1);
+    if (end > start) {
+        madvise((void*)start, end - start, MADV_DONTNEED);
+    }
+}
+
+// Incremental compaction. Walks the heap from hdr->compact_cursor; at each
+// free block, merges the free blocks after it into it and slides movable
+// blocks (handles that aren't pinned) down below it, so the free space
+// moves up until it reaches a block that can't move or the end of the heap.
+// Every class lock is held throughout, so a step stops once 'max_bytes'
+// have been moved or SEG_COMPACT_SCAN blocks looked at, leaving the cursor
+// on the block it got to. A pass runs from the start of the heap to its
+// end over as many steps as that takes; '*done' is set when one ends
+// having moved nothing. Returns the bytes moved.
+size_t seg_compact(allocator_t* a, size_t max_bytes, int* done) {
+    heap_header_t* hdr = a->hdr;
+    *done = 0;
+    if (hdr->seg_heap_size < sizeof(block_t) + MIN_BLOCK_SIZE) {
+        *done = 1;
+        return 0;
+    }
+
+    // Every list may change, so take every class lock (in ascending order)
+    for (size_t i = 0; i < NUM_SIZE_CLASSES; i++) {
+        class_lock(a, i);
+    }
+
+    char* start = (char*)a->seg_heap;
+    char* end = (char*)a->heap_end;
+    char* pos = hdr->compact_cursor ? (char*)HEAP_PTR(a, hdr->compact_cursor) : start;
+    size_t scanned = 0;
+    size_t moved = 0;
+
+    while (pos < end && scanned < SEG_COMPACT_SCAN) {
+        block_t* block = (block_t*)pos;
+        scanned++;
+        if (block->free != 1) {
+            pos += block->size;
+            continue;
+        }
+
+        seg_list_remove(a, block);
+        size_t hole = block->size;
+        int lifetime = block->lifetime;
+        int changed = 0;
+        int out_of_budget = 0;
+
+        while (pos + hole < end) {
+            if (scanned >= SEG_COMPACT_SCAN) {
+                out_of_budget = 1;
+                break;
+            }
+            block_t* next = (block_t*)(pos + hole);
+            scanned++;
+            if (next->free == 1) {
+                seg_list_remove(a, next);
+                if (next->lifetime != lifetime) lifetime = LIFETIME_GENERAL;
+                hole += next->size;
+                changed = 1;
+                continue;
+            }
+            if (moved > 0 && moved + next->size > max_bytes) {
+                out_of_budget = 1;
+                break;
+            }
+            if (!handle_claim_block(a, next)) break; // Can't move: pinned or not a handle
+
+            // Slide the block, header and all, to the start of the free space
+            size_t size = next->size;
+            memmove(pos, next, size);
+            handle_moved(a, (block_t*)pos);
+            pos += size;
+            moved += size;
+            changed = 1;
+            if (moved >= max_bytes) {
+                out_of_budget = 1;
+                break;
+            }
+        }
+
+        block = (block_t*)pos;
+        block->size = hole;
+        block->free = 1;
+        block->lifetime = lifetime;
+        seg_list_push(a, block);
+        if (changed) seg_release_pages(a, block);
+
+        if (out_of_budget) break;
+        pos += hole;
+    }
+
+    hdr->compact_moved += moved;
+    if (pos >= end) {
+        *done = hdr->compact_moved == 0;
+        hdr->compact_moved = 0;
+        hdr->compact_cursor = 0;
+    } else {
+        hdr->compact_cursor = HEAP_OFF(a, pos);
+    }
+
+    for (size_t i = NUM_SIZE_CLASSES; i-- > 0;) {
+        class_unlock(a, i);
+    }
+    return moved;
+}
+
+// Segregated list allocation (internal)
+void* seg_alloc_internal(allocator_t* a, size_t size, int lifetime) {
+    // Align requested size and add space for the block_t header
+    size = align_size(size + sizeof(block_t));
+
+    // Blocks aren't coalesced on free, so when nothing fits, merge adjacent
+    // free blocks once and try again before giving up. The retry is made even
+    // if nothing merged, since another thread may just have coalesced.
+    // Latency-critical heaps fail at once rather than walk the whole heap.
+    block_t* block = NULL;
+    for (int attempt = 0; attempt < 2; attempt++) {
+        block = seg_take(a, lifetime, size, 0);
+        if (!block && lifetime != LIFETIME_GENERAL) {
+            // A hinted lifetime reuses what it freed before growing, so its
+            // spans don't spread over the whole heap
+            if (seg_merge_lifetime(a, lifetime)) {
+                block = seg_take(a, lifetime, size, 0);
+            }
+            if (!block && seg_refill(a, lifetime, size)) {
+                block = seg_take(a, lifetime, size, 0);
+            }
+        }
+        if (block || attempt == 1 || a->latency_critical) break;
+        seg_coalesce(a);
+    }
+
+    // No suitable block found in segregated lists
+    if (!block) return NULL;
+
+    heap_count_alloc(a, block->size);
+
+    return (char*)block + sizeof(block_t); // Return pointer to user data
+}
+
 // Segregated list deallocation (internal)
-void seg_free_internal(void* ptr) {
+void seg_free_internal(allocator_t* a, void* ptr) {
     if (!ptr) return;
-    
+
     block_t* block = (block_t*)((char*)ptr - sizeof(block_t));
-    
+
     // Basic validation
     if (block->free) {
         fprintf(stderr, "Double free detected or freeing an already free segregated block: %p\n", ptr);
@@ -93,30 +465,12 @@ void seg_free_internal(void* ptr) {
         return;
     }
 
-    block->free = 1;
-    
-    g_allocator.free_count++;
-    g_allocator.total_allocated -= block->size;
-    g_allocator.total_free += block->size;
-    
-    // Simple coalescing with adjacent blocks
-    // This is a simplified version. A full implementation would involve:
-    // 1. Checking if the previous physical block is free and merge.
-    // 2. Checking if the next physical block is free and merge.
-    // This requires iterating through memory addresses to find neighbors,
-    // which can be slow, or maintaining a sorted list of all free blocks.
-    // For now, we'll only add to the free list.
-    
-    // Add to appropriate size class (head insertion)
-    size_t class_idx = get_size_class_index(block->size);
-    if (class_idx >= NUM_SIZE_CLASSES) {
-        class_idx = NUM_SIZE_CLASSES - 1; // Cap to the largest class
-    }
-    
-    block->next = g_allocator.size_classes[class_idx];
-    block->prev = NULL;
-    if (g_allocator.size_classes[class_idx]) {
-        g_allocator.size_classes[class_idx]->prev = block;
-    }
-    g_allocator.size_classes[class_idx] = block;
-}
\ No newline at end of file
+    heap_count_free(a, block->size);
+
+    // Coalescing with adjacent blocks is deferred to seg_coalesce(), which
+    // runs when an allocation can't be satisfied. Doing it here would mean
+    // finding the previous physical block on every free.
+
+    // Add to the head of its lifetime's size class list
+    seg_release(a, block);
+}
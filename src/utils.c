@@ -1,8 +1,305 @@
+#define _GNU_SOURCE // For syscall()
 #include "allocator.h" // For MIN_BLOCK_SIZE, MAX_ORDER, NUM_SIZE_CLASSES
 #include <stddef.h> // For size_t
+#include <stdio.h>
+#include <errno.h>
+#include <fcntl.h> // For open
+#include <string.h>
+#include <pthread.h> // For pthread_atfork
+#include <signal.h> // For kill
+#include <time.h>
+#include <unistd.h> // For syscall
+#include <sys/syscall.h> // For SYS_futex
+#include <linux/futex.h> // For FUTEX_WAIT, FUTEX_WAKE
 
 // Utility functions
 
+#define LOCK_SPIN_LIMIT 100 // Polls of a held lock before sleeping on it
+
+// Lock word states
+#define LOCK_FREE      0
+#define LOCK_HELD      1
+#define LOCK_CONTENDED 2    // Held, and someone may be sleeping on it
+
+// Set in the lock words of latency-critical heaps, whose waiters spin until
+// the lock is free instead of sleeping: a futex call costs more than the
+// short critical sections they wait for, and the heap makes no syscalls.
+// The words of such a lock are only ever LOCK_SPIN_ONLY | LOCK_FREE or
+// LOCK_SPIN_ONLY | LOCK_HELD.
+#define LOCK_SPIN_ONLY 0x80000000u
+
+// Set in the lock words of heaps shared between processes, which hold the
+// thread ID of their holder instead of LOCK_HELD, plus LOCK_WAITERS while
+// someone may be sleeping on them. A process that dies holding the lock
+// can't release it, so waiters wake up every LOCK_OWNER_CHECK_NS to check
+// the holder still exists, and take the lock over if it doesn't.
+#define LOCK_ROBUST    0x40000000u
+#define LOCK_WAITERS   0x20000000u
+#define LOCK_OWNER     0x1fffffffu  // Holder's thread ID (pid_max is at most 2^22)
+#define LOCK_OWNER_CHECK_NS 50000000L
+
+// Sets up a free lock word of the given HEAP_LOCK_* kind
+void heap_lock_init(uint32_t* lock, int kind) {
+    switch (kind) {
+        case HEAP_LOCK_SPIN:   *lock = LOCK_SPIN_ONLY | LOCK_FREE; break;
+        case HEAP_LOCK_ROBUST: *lock = LOCK_ROBUST; break;
+        default:               *lock = LOCK_FREE; break;
+    }
+}
+
+// Thread ID of the calling thread, as stored in robust lock words. Cached
+// per thread; a forked child has a new ID, so its cache is reset.
+static __thread uint32_t g_lock_owner_id;
+
+static void lock_owner_id_reset(void) {
+    g_lock_owner_id = 0;
+}
+
+static void lock_owner_id_register(void) {
+    pthread_atfork(NULL, NULL, lock_owner_id_reset);
+}
+
+static uint32_t lock_owner_id(void) {
+    static pthread_once_t registered = PTHREAD_ONCE_INIT;
+    if (!g_lock_owner_id) {
+        pthread_once(&registered, lock_owner_id_register);
+        g_lock_owner_id = (uint32_t)syscall(SYS_gettid);
+    }
+    return g_lock_owner_id;
+}
+
+// Whether thread 'tid' is gone. A process that has died but not been
+// reaped yet still answers kill(), so its state is read from /proc too.
+static int lock_owner_dead(pid_t tid) {
+    if (kill(tid, 0) == -1) return errno == ESRCH;
+
+    char path[32], stat[256];
+    snprintf(path, sizeof(path), "/proc/%d/stat", (int)tid);
+    int fd = open(path, O_RDONLY);
+    if (fd == -1) return errno == ENOENT;
+    ssize_t len = read(fd, stat, sizeof(stat) - 1);
+    close(fd);
+    if (len <= 0) return 0;
+    stat[len] = '\0';
+
+    // "pid (comm) state ...": comm may itself contain ')'
+    char* end = strrchr(stat, ')');
+    return end && end[1] == ' ' && (end[2] == 'Z' || end[2] == 'X');
+}
+
+// Acquires a robust lock word whose last seen value is 'state'
+static void robust_lock(uint32_t* lock, uint32_t state) {
+    uint32_t self = LOCK_ROBUST | lock_owner_id();
+    uint32_t waiters = 0; // LOCK_WAITERS once we've slept: others may be too
+    int spins = 0;
+
+    for (;;) {
+        if ((state & LOCK_OWNER) == 0) {
+            if (__atomic_compare_exchange_n(lock, &state, self | (state & LOCK_WAITERS) | waiters, 0,
+                                            __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+                return;
+            }
+            continue;
+        }
+        if (spins < LOCK_SPIN_LIMIT) {
+            spins++;
+            state = __atomic_load_n(lock, __ATOMIC_RELAXED);
+            continue;
+        }
+
+        // Ask to be woken, then sleep for a while at most
+        if (!(state & LOCK_WAITERS) &&
+            !__atomic_compare_exchange_n(lock, &state, state | LOCK_WAITERS, 0,
+                                         __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+            continue;
+        }
+        state |= LOCK_WAITERS;
+        waiters = LOCK_WAITERS;
+        struct timespec timeout = {0, LOCK_OWNER_CHECK_NS};
+        syscall(SYS_futex, lock, FUTEX_WAIT, state, &timeout, NULL, 0);
+
+        // Still held by the same thread: make sure it hasn't died
+        uint32_t now = __atomic_load_n(lock, __ATOMIC_RELAXED);
+        pid_t owner = (pid_t)(now & LOCK_OWNER);
+        if (now == state && lock_owner_dead(owner) &&
+            __atomic_compare_exchange_n(lock, &now, self | LOCK_WAITERS, 0,
+                                        __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+            fprintf(stderr, "Heap lock holder %d died holding the lock; lock taken over, "
+                    "the heap may need allocator_check_heap()\n", (int)owner);
+            return;
+        }
+        state = now;
+    }
+}
+
+// Acquires a lock word: spins briefly, since most critical sections are a few
+// list operations, then sleeps on a futex so a descheduled holder doesn't
+// leave waiters burning CPU. The word may live in memory shared between
+// processes, so only atomic builtins and non-private futexes are used, never
+// process-local state.
+void heap_lock(uint32_t* lock) {
+    // Robust words never equal LOCK_FREE, so send them straight to their own
+    // path rather than paying for a compare-exchange that must fail
+    uint32_t state = __atomic_load_n(lock, __ATOMIC_RELAXED);
+    if (state & LOCK_ROBUST) {
+        robust_lock(lock, state);
+        return;
+    }
+
+    state = LOCK_FREE;
+    if (__atomic_compare_exchange_n(lock, &state, LOCK_HELD, 0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+        return; // Uncontended
+    }
+
+    if (state & LOCK_SPIN_ONLY) {
+        for (;;) {
+            if (state == (LOCK_SPIN_ONLY | LOCK_FREE) &&
+                __atomic_compare_exchange_n(lock, &state, LOCK_SPIN_ONLY | LOCK_HELD, 0,
+                                            __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+                return;
+            }
+            state = __atomic_load_n(lock, __ATOMIC_RELAXED);
+        }
+    }
+
+    // Wait on plain loads so the cache line isn't bounced between waiters
+    for (int spins = 0; spins < LOCK_SPIN_LIMIT; spins++) {
+        if (__atomic_load_n(lock, __ATOMIC_RELAXED) == LOCK_FREE) {
+            state = LOCK_FREE;
+            if (__atomic_compare_exchange_n(lock, &state, LOCK_HELD, 0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+                return;
+            }
+        }
+    }
+
+    // Mark the lock contended so the holder wakes us, then sleep until it's
+    // released. Once we've slept we can't tell whether others are still
+    // waiting, so we keep the contended state when we get the lock.
+    while (__atomic_exchange_n(lock, LOCK_CONTENDED, __ATOMIC_ACQUIRE) != LOCK_FREE) {
+        syscall(SYS_futex, lock, FUTEX_WAIT, LOCK_CONTENDED, NULL, NULL, 0);
+    }
+}
+
+void heap_unlock(uint32_t* lock) {
+    uint32_t state = __atomic_load_n(lock, __ATOMIC_RELAXED);
+    if (state & LOCK_SPIN_ONLY) {
+        __atomic_store_n(lock, LOCK_SPIN_ONLY | LOCK_FREE, __ATOMIC_RELEASE);
+        return;
+    }
+    if (state & LOCK_ROBUST) {
+        if (__atomic_exchange_n(lock, LOCK_ROBUST, __ATOMIC_RELEASE) & LOCK_WAITERS) {
+            syscall(SYS_futex, lock, FUTEX_WAKE, 1, NULL, NULL, 0);
+        }
+        return;
+    }
+    if (__atomic_exchange_n(lock, LOCK_FREE, __ATOMIC_RELEASE) == LOCK_CONTENDED) {
+        syscall(SYS_futex, lock, FUTEX_WAKE, 1, NULL, NULL, 0);
+    }
+}
+
+// Counter stripe of the calling thread. Threads are spread over the stripes
+// in the order they first update a counter.
+static stat_stripe_t* stat_stripe(allocator_t* a) {
+    static unsigned int next_stripe;
+    static __thread unsigned int stripe; // 1-based, 0 until assigned
+
+    if (!stripe) {
+        stripe = __atomic_fetch_add(&next_stripe, 1, __ATOMIC_RELAXED) % STAT_STRIPES + 1;
+    }
+    return &a->hdr->stat_stripes[stripe - 1];
+}
+
+// Records an allocation of 'bytes'. With fine-grained locking the engines
+// don't hold a common lock, so updates go to the thread's counter stripe.
+void heap_count_alloc(allocator_t* a, size_t bytes) {
+    if (a->lock_mode == ALLOCATOR_LOCK_FINE) {
+        stat_stripe_t* stripe = stat_stripe(a);
+        __atomic_fetch_add(&stripe->allocated, bytes, __ATOMIC_RELAXED);
+        __atomic_fetch_add(&stripe->allocation_count, 1, __ATOMIC_RELAXED);
+        return;
+    }
+
+    heap_header_t* hdr = a->hdr;
+    hdr->allocation_count++;
+    hdr->total_allocated += bytes;
+    hdr->total_free -= bytes;
+}
+
+// Records a free of 'bytes'
+void heap_count_free(allocator_t* a, size_t bytes) {
+    if (a->lock_mode == ALLOCATOR_LOCK_FINE) {
+        stat_stripe_t* stripe = stat_stripe(a);
+        __atomic_fetch_sub(&stripe->allocated, bytes, __ATOMIC_RELAXED);
+        __atomic_fetch_add(&stripe->free_count, 1, __ATOMIC_RELAXED);
+        return;
+    }
+
+    heap_header_t* hdr = a->hdr;
+    hdr->free_count++;
+    hdr->total_allocated -= bytes;
+    hdr->total_free += bytes;
+}
+
+// Records an allocation of 'bytes' charged to 'tag'. Tags are counted in
+// one place per tag rather than striped, so with fine-grained locking the
+// counters are updated atomically, and the peak by compare-and-swap only
+// when it's exceeded.
+void heap_count_tag_alloc(allocator_t* a, unsigned int tag, size_t bytes) {
+    tag_counters_t* counters = &a->hdr->tags[tag];
+
+    if (a->lock_mode == ALLOCATOR_LOCK_FINE) {
+        size_t live = __atomic_add_fetch(&counters->live_bytes, bytes, __ATOMIC_RELAXED);
+        size_t peak = __atomic_load_n(&counters->peak_bytes, __ATOMIC_RELAXED);
+        while (live > peak &&
+               !__atomic_compare_exchange_n(&counters->peak_bytes, &peak, live, 1,
+                                            __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+        }
+        __atomic_fetch_add(&counters->allocation_count, 1, __ATOMIC_RELAXED);
+        return;
+    }
+
+    counters->live_bytes += bytes;
+    if (counters->live_bytes > counters->peak_bytes) counters->peak_bytes = counters->live_bytes;
+    counters->allocation_count++;
+}
+
+// Records a free of 'bytes' charged to 'tag'
+void heap_count_tag_free(allocator_t* a, unsigned int tag, size_t bytes) {
+    tag_counters_t* counters = &a->hdr->tags[tag];
+
+    if (a->lock_mode == ALLOCATOR_LOCK_FINE) {
+        __atomic_fetch_sub(&counters->live_bytes, bytes, __ATOMIC_RELAXED);
+        __atomic_fetch_add(&counters->free_count, 1, __ATOMIC_RELAXED);
+        return;
+    }
+
+    counters->live_bytes -= bytes;
+    counters->free_count++;
+}
+
+// Fills in the counter fields of 'stats', folding in the stripes and the
+// per-CPU cache hits. While other threads are running the result is a close
+// snapshot, not an exact one.
+void heap_read_counters(const allocator_t* a, allocator_stats_t* stats) {
+    const heap_header_t* hdr = a->hdr;
+    size_t allocated = hdr->total_allocated;
+    size_t allocation_count = hdr->allocation_count;
+    size_t free_count = hdr->free_count;
+
+    for (int i = 0; i < STAT_STRIPES; i++) {
+        allocated += __atomic_load_n(&hdr->stat_stripes[i].allocated, __ATOMIC_RELAXED);
+        allocation_count += __atomic_load_n(&hdr->stat_stripes[i].allocation_count, __ATOMIC_RELAXED);
+        free_count += __atomic_load_n(&hdr->stat_stripes[i].free_count, __ATOMIC_RELAXED);
+    }
+    percpu_cache_counts(a, &allocation_count, &free_count); // Cache hits
+
+    stats->heap_size = hdr->heap_size - hdr->buddy_heap; // Less header and bitmaps
+    stats->allocated_bytes = allocated;
+    stats->free_bytes = stats->heap_size - allocated;
+    stats->allocation_count = allocation_count;
+    stats->free_count = free_count;
+}
+
 // Aligns size to 8 bytes. This is typically important for data alignment
 // to avoid performance penalties and ensure proper access for certain data types.
 size_t align_size(size_t size) {
@@ -26,7 +323,7 @@ int get_order(size_t size) {
 
 // Maps a given size to a segregated list size class index.
 // The size classes are powers of 2 from 16 up to 32768 (2^15).
-size_t get_size_class_index(size_t size) {
+size_t get_size_class_index(const allocator_t* a, size_t size) {
     // Map sizes to size classes (powers of 2 from 16 to 16 * 2^(NUM_SIZE_CLASSES-1))
     // This assumes class_sizes[i] = MIN_BLOCK_SIZE << i.
     // So, MIN_BLOCK_SIZE (16) is index 0.
@@ -35,16 +332,16 @@ size_t get_size_class_index(size_t size) {
     // 16 * 2^10 = 16384 is index 10.
     // 16 * 2^11 = 32768 is index 11.
 
-    if (size <= g_allocator.class_sizes[0]) return 0; // 16
-    if (size <= g_allocator.class_sizes[1]) return 1; // 32
-    if (size <= g_allocator.class_sizes[2]) return 2; // 64
-    if (size <= g_allocator.class_sizes[3]) return 3; // 128
-    if (size <= g_allocator.class_sizes[4]) return 4; // 256
-    if (size <= g_allocator.class_sizes[5]) return 5; // 512
-    if (size <= g_allocator.class_sizes[6]) return 6; // 1024
-    if (size <= g_allocator.class_sizes[7]) return 7; // 2048
-    if (size <= g_allocator.class_sizes[8]) return 8; // 4096
-    if (size <= g_allocator.class_sizes[9]) return 9; // 8192
-    if (size <= g_allocator.class_sizes[10]) return 10; // 16384
+    if (size <= a->class_sizes[0]) return 0; // 16
+    if (size <= a->class_sizes[1]) return 1; // 32
+    if (size <= a->class_sizes[2]) return 2; // 64
+    if (size <= a->class_sizes[3]) return 3; // 128
+    if (size <= a->class_sizes[4]) return 4; // 256
+    if (size <= a->class_sizes[5]) return 5; // 512
+    if (size <= a->class_sizes[6]) return 6; // 1024
+    if (size <= a->class_sizes[7]) return 7; // 2048
+    if (size <= a->class_sizes[8]) return 8; // 4096
+    if (size <= a->class_sizes[9]) return 9; // 8192
+    if (size <= a->class_sizes[10]) return 10; // 16384
     return NUM_SIZE_CLASSES - 1; // 32768 and above (maps to the largest class)
 }
\ No newline at end of file
@@ -0,0 +1,102 @@
+#define _POSIX_C_SOURCE 199309L // For clock_gettime
+#include "memory_allocator.h"
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+// Compaction steps stay short on a heap of blocks that can't move, since
+// every step holds all the size class locks, and passes still finish.
+
+#define COMPACT_HEAP_SIZE (64 * 1024 * 1024)
+#define COMPACT_MAX_BLOCKS (1024 * 1024)
+#define COMPACT_HANDLES 1000
+
+static void* blocks[COMPACT_MAX_BLOCKS];
+static double step_ms[COMPACT_MAX_BLOCKS];
+
+static double elapsed_ms(const struct timespec* start, const struct timespec* end) {
+    return (double)(end->tv_sec - start->tv_sec) * 1e3 + (double)(end->tv_nsec - start->tv_nsec) / 1e6;
+}
+
+static int compare_ms(const void* x, const void* y) {
+    double a = *(const double*)x, b = *(const double*)y;
+    return (a > b) - (a < b);
+}
+
+int main(void) {
+    allocator_config_t config = {0};
+    config.engine = ALLOCATOR_ENGINE_SEGREGATED;
+    config.heap_size = COMPACT_HEAP_SIZE;
+    config.lock_mode = ALLOCATOR_LOCK_FINE;
+    allocator_t* a = allocator_create(&config);
+    assert(a);
+
+    // Ordinary allocations fill the heap, every other one freed: nothing
+    // can move, and a pass has to look at every block
+    size_t n = 0;
+    while (n < COMPACT_MAX_BLOCKS && (blocks[n] = allocator_malloc(a, 64)) != NULL) n++;
+    assert(n > 100000 && n < COMPACT_MAX_BLOCKS);
+    for (size_t i = 0; i < n; i += 2) allocator_free(a, blocks[i]);
+
+    size_t steps = 0, moved = 0;
+    int done = 0;
+    struct timespec start, end, pass_start;
+    clock_gettime(CLOCK_MONOTONIC, &pass_start);
+    while (!done) {
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        moved += allocator_compact(a, 1024 * 1024, &done);
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        step_ms[steps++] = elapsed_ms(&start, &end);
+        assert(steps < n);
+    }
+    double pass_ms = elapsed_ms(&pass_start, &end);
+
+    // Each step looked at a bounded number of blocks, so the pass took
+    // many of them, each a small part of it
+    assert(moved == 0);
+    assert(steps >= n / 4096);
+    qsort(step_ms, steps, sizeof(double), compare_ms);
+    double median = step_ms[steps / 2];
+    printf("%zu blocks: %zu steps, median %.3fms, whole pass %.2fms\n", n, steps, median, pass_ms);
+    assert(median * 16 < pass_ms);
+
+    for (size_t i = 1; i < n; i += 2) allocator_free(a, blocks[i]);
+
+    // Handles between ordinary blocks: passes move them until one moves
+    // nothing, and their contents come along
+    static allocator_handle_t handles[COMPACT_HANDLES];
+    static void* fixed[COMPACT_HANDLES];
+    for (int i = 0; i < COMPACT_HANDLES; i++) {
+        handles[i] = allocator_handle_alloc(a, 100);
+        assert(handles[i]);
+        memset(allocator_handle_pin(a, handles[i]), i & 0xff, 100);
+        allocator_handle_unpin(a, handles[i]);
+        fixed[i] = allocator_malloc(a, 100);
+        assert(fixed[i]);
+    }
+    for (int i = 0; i < COMPACT_HANDLES; i += 2) {
+        allocator_free(a, fixed[i]);
+        allocator_handle_free(a, handles[i]);
+    }
+
+    moved = 0;
+    done = 0;
+    while (!done) moved += allocator_compact(a, 16 * 1024, &done);
+    assert(moved > 0);
+    moved = 0;
+    done = 0;
+    while (!done) moved += allocator_compact(a, 16 * 1024, &done);
+    assert(moved == 0); // Nothing left to move
+
+    for (int i = 1; i < COMPACT_HANDLES; i += 2) {
+        unsigned char* p = allocator_handle_pin(a, handles[i]);
+        for (int k = 0; k < 100; k++) assert(p[k] == (i & 0xff));
+        allocator_handle_unpin(a, handles[i]);
+    }
+
+    allocator_destroy(a);
+    printf("Compaction tests passed\n");
+    return 0;
+}
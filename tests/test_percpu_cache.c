@@ -0,0 +1,67 @@
+#include "memory_allocator.h"
+#include <assert.h>
+#include <stdio.h>
+#include <string.h>
+
+// Per-CPU cache hits show up in the allocation and free counts, and a
+// failing allocation gets back the memory the caches hold.
+
+#define PERCPU_PAIRS 1000
+#define PERCPU_BLOCKS 8192
+
+int main(void) {
+    allocator_config_t config = {0};
+    config.engine = ALLOCATOR_ENGINE_SEGREGATED;
+    config.heap_size = 256 * 1024;
+    config.percpu_cache_limit = 16;
+    allocator_t* a = allocator_create(&config);
+    assert(a);
+
+    allocator_stats_t stats;
+    allocator_get_stats(a, &stats);
+    size_t allocs = stats.allocation_count;
+    size_t frees = stats.free_count;
+
+    for (int i = 0; i < PERCPU_PAIRS; i++) {
+        void* p = allocator_malloc(a, 64);
+        assert(p);
+        memset(p, i, 64);
+        allocator_free(a, p);
+    }
+    allocator_get_stats(a, &stats);
+    if (stats.cached_bytes == 0) {
+        printf("Per-CPU caches unavailable, skipping\n");
+        allocator_destroy(a);
+        return 0;
+    }
+    assert(stats.allocation_count - allocs == PERCPU_PAIRS);
+    assert(stats.free_count - frees == PERCPU_PAIRS);
+
+    // Fill the heap with small blocks, then free them all. The first ones
+    // freed stay cached, spread through the heap, and only a flush lets the
+    // free space merge into one block again.
+    static void* blocks[PERCPU_BLOCKS];
+    int n = 0;
+    while (n < PERCPU_BLOCKS && (blocks[n] = allocator_malloc(a, 64)) != NULL) n++;
+    assert(n > 0 && n < PERCPU_BLOCKS);
+    int step = n / 8;
+    for (int i = 0; i < n; i += step) allocator_free(a, blocks[i]);
+    for (int i = 0; i < n; i++) {
+        if (i % step) allocator_free(a, blocks[i]);
+    }
+
+    allocator_get_stats(a, &stats);
+    assert(stats.cached_bytes > 0);
+    assert(stats.allocation_count - stats.free_count == 0);
+
+    void* big = allocator_malloc(a, config.heap_size / 2);
+    assert(big);
+    allocator_get_stats(a, &stats);
+    assert(stats.cached_bytes == 0);
+    assert(stats.allocation_count - stats.free_count == 1);
+    allocator_free(a, big);
+
+    allocator_destroy(a);
+    printf("Per-CPU cache tests passed\n");
+    return 0;
+}
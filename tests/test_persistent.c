@@ -0,0 +1,83 @@
+#define _GNU_SOURCE // For unlink
+#include "memory_allocator.h"
+#include <assert.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+// A persistent heap larger than the 1MB default keeps its size, its large
+// allocations and its root across a reopen.
+
+#define PERSISTENT_PATH "/tmp/test_persistent_heap.bin"
+#define PERSISTENT_HEAP_SIZE (16 * 1024 * 1024)
+#define PERSISTENT_LARGE_SIZE (3 * 1024 * 1024)
+#define PERSISTENT_ENTRIES 1000
+
+typedef struct {
+    size_t large;                   // Offset of the large block
+    size_t entries[PERSISTENT_ENTRIES]; // Offsets of small blocks
+} persistent_root_t;
+
+static void fill(unsigned char* p, size_t size, unsigned int seed) {
+    for (size_t i = 0; i < size; i++) p[i] = (unsigned char)(i * 31 + seed);
+}
+
+static int filled(const unsigned char* p, size_t size, unsigned int seed) {
+    for (size_t i = 0; i < size; i++) {
+        if (p[i] != (unsigned char)(i * 31 + seed)) return 0;
+    }
+    return 1;
+}
+
+int main(void) {
+    unlink(PERSISTENT_PATH);
+
+    allocator_config_t config = {0};
+    config.heap_size = PERSISTENT_HEAP_SIZE;
+    assert(allocator_open_file(PERSISTENT_PATH, &config) == 0);
+
+    allocator_stats_t stats;
+    allocator_get_stats(NULL, &stats);
+    assert(stats.heap_size >= PERSISTENT_HEAP_SIZE);
+    size_t heap_size = stats.heap_size;
+
+    persistent_root_t* root = my_malloc(sizeof(*root));
+    unsigned char* large = my_malloc(PERSISTENT_LARGE_SIZE);
+    assert(root && large);
+    fill(large, PERSISTENT_LARGE_SIZE, 7);
+    root->large = allocator_ptr_to_offset(large);
+    for (unsigned int i = 0; i < PERSISTENT_ENTRIES; i++) {
+        unsigned char* entry = my_malloc(64 + i % 200);
+        assert(entry);
+        fill(entry, 64 + i % 200, i);
+        root->entries[i] = allocator_ptr_to_offset(entry);
+    }
+    allocator_set_root(root);
+    allocator_cleanup();
+
+    // A different config on reopen is ignored: the stored size wins
+    allocator_config_t other = {0};
+    other.heap_size = 1024 * 1024;
+    assert(allocator_open_file(PERSISTENT_PATH, &other) == 0);
+    allocator_get_stats(NULL, &stats);
+    assert(stats.heap_size == heap_size);
+
+    root = allocator_get_root();
+    assert(root);
+    large = allocator_offset_to_ptr(root->large);
+    assert(filled(large, PERSISTENT_LARGE_SIZE, 7));
+    for (unsigned int i = 0; i < PERSISTENT_ENTRIES; i++) {
+        assert(filled(allocator_offset_to_ptr(root->entries[i]), 64 + i % 200, i));
+    }
+    assert(allocator_check_heap() == 0);
+
+    // The reopened heap still has room past the default size
+    void* more = my_malloc(1536 * 1024);
+    assert(more);
+    my_free(more);
+    allocator_cleanup();
+
+    unlink(PERSISTENT_PATH);
+    printf("test_persistent: %zu byte heap reopened with its data\n", heap_size);
+    return 0;
+}